@@ -7,7 +7,8 @@
  * of 16 bytes is expanded to a 11 * 16 byte key to provide 11 separate key
  * blocks. One key block for each round plus the initial key XOR.
  *
- * The data block represents a square matrix of order 4, denoted by WORD_SIZE.
+ * The data block represents a square matrix of order 4, denoted by WORD_SIZE,
+ * stored in column-major order. Blocks are transformed in place.
  * Additionally, the key expansion algorithm expands the key in steps of 4
  * bytes, denoted by KEY_STEP. The algorithm is built with these assumptions, so
  * changing the constants will result in bugs.
@@ -20,11 +21,12 @@
 /* -- Includes -- */
 #include "AES.h" /* for the public function prototypes */
 #include "byte_ops.h" /* for supporting byte array operations & finite field arithmetic */
+#include "key_cache.h" /* for cached key schedules */
 
 /* AES defining constants */
-const size_t BLOCK_SIZE = 16;
-const size_t KEY_SIZE = 16;
-const int NUM_ROUNDS = 10;
+const size_t BLOCK_SIZE = AES_BLOCK_LEN;
+const size_t KEY_SIZE = AES_KEY_LEN;
+const int NUM_ROUNDS = AES_ROUNDS;
 const size_t WORD_SIZE = 4;
 const int KEY_STEP = 4;
 
@@ -39,17 +41,39 @@ static void keyExpansion(uint8_t initialKey[], uint8_t *expandedKey,
                          int rounds);
 static uint8_t *expansionCore(uint8_t bytes[], int roundNum);
 
+uint8_t *encrypt(uint8_t block[], uint8_t key[]) {
+  return encryptBlock(block, keyCacheLast(key));
+}
+
+uint8_t *decrypt(uint8_t block[], uint8_t key[]) {
+  return decryptBlock(block, keyCacheLast(key));
+}
+
 /**
- * AES encrypts a block of bytes using multiple rounds. The block is operated on
- * as a square matrix which is locally stored in the "state" array using
- * column-major order.
+ * The decryption form is the encryption form with the order of the round key
+ * blocks reversed. Since InvMixColumns is linear, it can be applied to the
+ * middle round keys here once instead of being moved around the AddRoundKey
+ * step in every block.
  */
-uint8_t *encrypt(uint8_t block[], uint8_t key[]) {
-  uint8_t expandedKey[(NUM_ROUNDS + 1) * BLOCK_SIZE];
-  uint8_t state[BLOCK_SIZE];
+void expandKey(uint8_t key[], KeySchedule *schedule) {
+  keyExpansion(key, schedule->enc, NUM_ROUNDS);
+  for (int i = 0; i <= NUM_ROUNDS; i++) {
+    copy(schedule->dec, BLOCK_SIZE * i, schedule->enc,
+         BLOCK_SIZE * (NUM_ROUNDS - i), BLOCK_SIZE);
+    if (i > 0 && i < NUM_ROUNDS)
+      mixColumns(&schedule->dec[BLOCK_SIZE * i], DECRYPT);
+  }
+}
 
-  keyExpansion(key, expandedKey, NUM_ROUNDS);
-  transpose(block, state, WORD_SIZE, WORD_SIZE);
+/**
+ * AES encrypts a block of bytes using multiple rounds. The block is operated on
+ * in place as a square matrix stored in column-major order, which is the order
+ * the bytes of a block already come in. Byte (r, c) of the state is at index
+ * r + (WORD_SIZE * c).
+ */
+uint8_t *encryptBlock(uint8_t block[], const KeySchedule *schedule) {
+  uint8_t *expandedKey = (uint8_t *)schedule->enc;
+  uint8_t *state = block;
 
   addRoundKey(state, expandedKey, 0);
   for (int i = 1; i <= NUM_ROUNDS; i++) {
@@ -59,31 +83,27 @@ uint8_t *encrypt(uint8_t block[], uint8_t key[]) {
       mixColumns(state, ENCRYPT);
     addRoundKey(state, expandedKey, i);
   }
-
-  transpose(state, block, WORD_SIZE, WORD_SIZE);
   return block;
 }
 
 /**
- * Just the exact reverse of encryption
+ * The equivalent inverse cipher, which has the same sequence of steps as
+ * encryption with each step replaced by its inverse. This works because
+ * InvSubBytes and InvShiftRows commute, and the decryption form of the
+ * schedule has its round keys adjusted to come after InvMixColumns.
  */
-uint8_t *decrypt(uint8_t block[], uint8_t key[]) {
-  uint8_t expandedKey[(NUM_ROUNDS + 1) * BLOCK_SIZE];
-  uint8_t state[BLOCK_SIZE];
-
-  keyExpansion(key, expandedKey, NUM_ROUNDS);
-  transpose(block, state, WORD_SIZE, WORD_SIZE);
+uint8_t *decryptBlock(uint8_t block[], const KeySchedule *schedule) {
+  uint8_t *expandedKey = (uint8_t *)schedule->dec;
+  uint8_t *state = block;
 
-  for (int i = NUM_ROUNDS; i > 0; i--) {
-    addRoundKey(state, expandedKey, i);
+  addRoundKey(state, expandedKey, 0);
+  for (int i = 1; i <= NUM_ROUNDS; i++) {
+    subBytes(state, DECRYPT);
+    invShiftRows(state);
     if (i < NUM_ROUNDS)
       mixColumns(state, DECRYPT);
-    invShiftRows(state);
-    subBytes(state, DECRYPT);
+    addRoundKey(state, expandedKey, i);
   }
-  addRoundKey(state, expandedKey, 0);
-
-  transpose(state, block, WORD_SIZE, WORD_SIZE);
   return block;
 }
 
@@ -98,7 +118,7 @@ uint8_t checkPad(uint8_t block[]) {
     return 0;
 
   uint8_t padBytes = pad ? pad : BLOCK_SIZE; /* zero padding = 16 bytes*/
-  for (size_t i = BLOCK_SIZE - 1; i >= (BLOCK_SIZE - padBytes); i--) {
+  for (size_t i = BLOCK_SIZE - padBytes; i < BLOCK_SIZE; i++) {
     if (block[i] != pad)
       return 0;
   }
@@ -114,14 +134,12 @@ void pad(uint8_t block[], size_t len) {
   }
 }
 
+/**
+ * The key expansion produces the round keys one column at a time, so each key
+ * block is already in the same column-major order as the state.
+ */
 void addRoundKey(uint8_t bytes[], uint8_t expandedKey[], int roundNum) {
-  uint8_t roundKey[BLOCK_SIZE];
-  uint8_t temp[BLOCK_SIZE];
-
-  /* the key block is transposed to match "state" orientation */
-  copy(temp, 0, expandedKey, BLOCK_SIZE * roundNum, BLOCK_SIZE);
-  transpose(temp, roundKey, WORD_SIZE, WORD_SIZE);
-  arrXor(bytes, roundKey, BLOCK_SIZE);
+  arrXor(bytes, &expandedKey[BLOCK_SIZE * roundNum], BLOCK_SIZE);
 }
 
 void subBytes(uint8_t bytes[], Direction direction) {
@@ -185,50 +203,63 @@ uint8_t subByte(uint8_t byte, Direction direction) {
   return (direction == ENCRYPT) ? SBOX[byte] : INVSBOX[byte];
 }
 
+/* row r is rotated left by r columns */
 void shiftRows(uint8_t bytes[]) {
-  uint8_t row[WORD_SIZE];
-  for (size_t i = 1; i < WORD_SIZE; i++) {
-    copy(row, 0, bytes, (WORD_SIZE * i),
-         WORD_SIZE); /*  copy row to be shifted */
-    rotateLeft(row, WORD_SIZE, i);
-    copy(bytes, (WORD_SIZE * i), row, 0, WORD_SIZE); /* copy back shifted row */
+  uint8_t temp[BLOCK_SIZE];
+  copy(temp, 0, bytes, 0, BLOCK_SIZE);
+  for (size_t r = 1; r < WORD_SIZE; r++) {
+    for (size_t c = 0; c < WORD_SIZE; c++) {
+      size_t from = (c + r) % WORD_SIZE;
+      bytes[r + (WORD_SIZE * c)] = temp[r + (WORD_SIZE * from)];
+    }
   }
 }
 
+/* row r is rotated right by r columns */
 void invShiftRows(uint8_t bytes[]) {
-  uint8_t row[WORD_SIZE];
-  for (size_t i = 1; i < WORD_SIZE; i++) {
-    copy(row, 0, bytes, (WORD_SIZE * i),
-         WORD_SIZE); /*  copy row to be shifted */
-    rotateLeft(row, WORD_SIZE, WORD_SIZE - i);
-    copy(bytes, (WORD_SIZE * i), row, 0, WORD_SIZE); /* copy back shifted row */
+  uint8_t temp[BLOCK_SIZE];
+  copy(temp, 0, bytes, 0, BLOCK_SIZE);
+  for (size_t r = 1; r < WORD_SIZE; r++) {
+    for (size_t c = 0; c < WORD_SIZE; c++) {
+      size_t to = (c + r) % WORD_SIZE;
+      bytes[r + (WORD_SIZE * to)] = temp[r + (WORD_SIZE * c)];
+    }
   }
 }
 
+/**
+ * Each column of the state is a contiguous run of WORD_SIZE bytes, so it is
+ * multiplied by the matrix straight from a copy of itself.
+ *
+ * The inverse matrix, with entries 0x0E, 0x0B, 0x0D and 0x09, factors into the
+ * forward matrix times one whose rows are 0x05 on the diagonal and 0x04 two
+ * columns over. Decryption multiplies by that second matrix first, which takes
+ * two xtime calls per pair of bytes, and then shares the cheap forward
+ * multiplication with encryption.
+ */
 void mixColumns(uint8_t bytes[], Direction direction) {
-  uint8_t *column;
-  uint8_t rows[WORD_SIZE][WORD_SIZE];
+  uint8_t column[WORD_SIZE];
 
+  /* matrix representation of the linear transformation in the MixColumns step,
+   * stored in row-major order */
   static uint8_t MBOX[] = {0x02, 0x03, 0x01, 0x01, 0x01, 0x02, 0x03, 0x01,
                            0x01, 0x01, 0x02, 0x03, 0x03, 0x01, 0x01, 0x02};
-  static uint8_t INVMBOX[] = {0x0E, 0x0B, 0x0D, 0x09, 0x09, 0x0E, 0x0B, 0x0D,
-                              0x0D, 0x09, 0x0E, 0x0B, 0x0B, 0x0D, 0x09, 0x0E};
+  uint8_t *matrix = MBOX;
 
-  /* matrix representation of the linear transformation in the MixColumns step
-   */
-  uint8_t *matrix = (direction == ENCRYPT) ? MBOX : INVMBOX;
-
-  for (size_t i = 0; i < WORD_SIZE; i++) {
-    copy(rows[i], 0, matrix, i * WORD_SIZE, WORD_SIZE);
-  }
-
-  /* standard matrix multiplication */
   for (size_t j = 0; j < WORD_SIZE; j++) {
-    column = slice(bytes, j, j + ((WORD_SIZE - 1) * WORD_SIZE), WORD_SIZE);
+    copy(column, 0, bytes, j * WORD_SIZE, WORD_SIZE);
+    if (direction == DECRYPT) {
+      for (size_t i = 0; i < WORD_SIZE / 2; i++) {
+        uint8_t quad = xtime(xtime(column[i] ^ column[i + 2]));
+        column[i] ^= quad;
+        column[i + 2] ^= quad;
+      }
+    }
+    /* standard matrix multiplication */
     for (size_t i = 0; i < WORD_SIZE; i++) {
-      bytes[(i * WORD_SIZE) + j] = dot(rows[i], column, WORD_SIZE);
+      bytes[i + (j * WORD_SIZE)] =
+          dot(&matrix[i * WORD_SIZE], column, WORD_SIZE);
     }
-    free(column);
   }
 }
 
@@ -19,15 +19,38 @@
 
 typedef enum { ENCRYPT, DECRYPT } Direction;
 
+/* the values behind the constants below, for sizing arrays in structs */
+#define AES_BLOCK_LEN 16
+#define AES_KEY_LEN 16
+#define AES_ROUNDS 10
+
 extern const size_t WORD_SIZE;
 extern const size_t BLOCK_SIZE; /* 16 bytes */
 extern const size_t KEY_SIZE;   /* 128 bit - 16 bytes */
 extern const int NUM_ROUNDS;
 
+#define SCHEDULE_LEN ((AES_ROUNDS + 1) * AES_BLOCK_LEN)
+
+/**
+ * Expanded key schedule for a single key. The encryption form holds the round
+ * keys in the order they are applied during encryption. The decryption form
+ * holds them in reverse order, with InvMixColumns already applied to all but
+ * the first and last, for the equivalent inverse cipher of FIPS-197.
+ */
+typedef struct {
+  uint8_t enc[SCHEDULE_LEN];
+  uint8_t dec[SCHEDULE_LEN];
+} KeySchedule;
+
 /**
  * @brief Encrypts a block of bytes using AES-128 and the given key.
  *
- * Both the key and the data block should be 16 bytes long.
+ * Both the key and the data block should be 16 bytes long. The expanded key
+ * schedule is looked up in the key cache, so it is only computed the first time
+ * a key is seen, and each thread keeps the schedule of its last key so that
+ * repeated calls with one key skip the cache as well (see keyCacheLast()).
+ * Code that encrypts many blocks should still look the schedule up once and
+ * call encryptBlock().
  *
  * @param block The block of bytes to be encrypted
  * @param key The key
@@ -40,7 +63,8 @@ uint8_t *encrypt(uint8_t block[], uint8_t key[]);
  * @brief Decrypts a block of bytes encrypted using this program and the given
  * key.
  *
- * Both the key and the data block should be 16 bytes long.
+ * Both the key and the data block should be 16 bytes long. The expanded key
+ * schedule is looked up in the same way as for encrypt().
  *
  * @param block The encrypted block of bytes to be decrypted
  * @param key The key used during encryption
@@ -49,6 +73,41 @@ uint8_t *encrypt(uint8_t block[], uint8_t key[]);
  */
 uint8_t *decrypt(uint8_t block[], uint8_t key[]);
 
+/**
+ * @brief Expands a 16 byte key into both forms of its key schedule.
+ *
+ * The schedule holds round key material, so callers should wipe it once done.
+ *
+ * @param key The key
+ * @param schedule The schedule to fill in
+ */
+void expandKey(uint8_t key[], KeySchedule *schedule);
+
+/**
+ * @brief Encrypts a block of bytes using AES-128 and an expanded key schedule.
+ *
+ * Same as encrypt(), but skips the key expansion. Used when many blocks are
+ * encrypted with the same key.
+ *
+ * @param block The block of bytes to be encrypted
+ * @param schedule The expanded key schedule
+ *
+ * @return The encrypted block
+ */
+uint8_t *encryptBlock(uint8_t block[], const KeySchedule *schedule);
+
+/**
+ * @brief Decrypts a block of bytes using AES-128 and an expanded key schedule.
+ *
+ * Same as decrypt(), but skips the key expansion.
+ *
+ * @param block The encrypted block of bytes to be decrypted
+ * @param schedule The expanded key schedule used during encryption
+ *
+ * @return The decrypted block
+ */
+uint8_t *decryptBlock(uint8_t block[], const KeySchedule *schedule);
+
 /**
  * @brief Checks if an block has a valid PKCS7 padding.
  *
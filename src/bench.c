@@ -0,0 +1,209 @@
+/**
+ * @file bench.c
+ * @brief Benchmark harness for the cipher and its helpers.
+ *
+ * Runs each benchmark case over an in-memory buffer and prints its throughput.
+ * With the -p option, hardware performance counters are also collected for
+ * each case and reported per byte and per block, along with the instructions
+ * per cycle. If the counters can't be opened (no kernel support, a virtual
+ * machine without a PMU, or a restrictive perf_event_paranoid setting), the
+ * harness says so and reports times only.
+ *
+ * @author Ali Zaheer
+ */
+
+/* for clock_gettime */
+#define _POSIX_C_SOURCE 200809L
+
+/* -- Includes -- */
+#include "AES.h"           /* for the cipher */
+#include "byte_ops.h"      /* for wipe */
+#include "key_cache.h"     /* for the key cache */
+#include "perf_counters.h" /* for the hardware counters */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define ERROR_USE                                                              \
+  "Usage: bench [-p] [-n bytes] [-r repetitions]\n\
+    -p collects hardware performance counters for each case\n\
+    -n sets the buffer size, rounded down to whole blocks (default 1048576)\n\
+    -r sets how many times each case runs over the buffer (default 4)\n"
+
+typedef struct {
+  const char *name;
+  /* processes every block of the buffer once */
+  void (*run)(uint8_t buf[], size_t len, const KeySchedule *schedule);
+} BenchCase;
+
+static uint8_t KEY[] = "0123456789abcdef";
+
+#define NUM_KEYS 4 /* keys taking turns in the key cache case */
+static uint8_t KEYS[NUM_KEYS][17] = {"0123456789abcdef", "123456789abcdef0",
+                                     "23456789abcdef01", "3456789abcdef012"};
+
+/* Local functions */
+static void benchEncrypt(uint8_t buf[], size_t len, const KeySchedule *sched);
+static void benchDecrypt(uint8_t buf[], size_t len, const KeySchedule *sched);
+static void benchLibrary(uint8_t buf[], size_t len, const KeySchedule *sched);
+static void benchCached(uint8_t buf[], size_t len, const KeySchedule *sched);
+static void benchExpand(uint8_t buf[], size_t len, const KeySchedule *sched);
+static void benchCheckPad(uint8_t buf[], size_t len, const KeySchedule *sched);
+static uint64_t now(void);
+
+static const BenchCase CASES[] = {
+    {"encryptBlock", benchEncrypt}, {"decryptBlock", benchDecrypt},
+    {"encrypt (same key)", benchLibrary}, {"encrypt (key cache)", benchCached},
+    {"expandKey", benchExpand}, {"checkPad", benchCheckPad}};
+
+int main(int argc, char *argv[]) {
+  bool usePerf = false;
+  size_t len = 1 << 20;
+  long reps = 4;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-p") == 0) {
+      usePerf = true;
+    } else if ((i < argc - 1) && (strcmp(argv[i], "-n") == 0)) {
+      len = strtoul(argv[++i], NULL, 10);
+    } else if ((i < argc - 1) && (strcmp(argv[i], "-r") == 0)) {
+      reps = strtol(argv[++i], NULL, 10);
+    } else {
+      fprintf(stderr, ERROR_USE);
+      exit(EXIT_FAILURE);
+    }
+  }
+  len -= len % BLOCK_SIZE;
+  if (len == 0 || reps < 1) {
+    fprintf(stderr, ERROR_USE);
+    exit(EXIT_FAILURE);
+  }
+
+  uint8_t *buf = (uint8_t *)malloc(len);
+  if (buf == NULL) {
+    fprintf(stderr, "Could not allocate %zu byte buffer\n", len);
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < len; i++) {
+    buf[i] = (uint8_t)(i * 31 + 7);
+  }
+
+  PerfCounters counters;
+  if (usePerf && !perfOpen(&counters)) {
+    fprintf(stderr, "Hardware counters unavailable, reporting times only\n");
+    usePerf = false;
+  }
+
+  KeySchedule schedule;
+  expandKey(KEY, &schedule);
+
+  double bytes = (double)len * reps;
+  double blocks = bytes / BLOCK_SIZE;
+  printf("%-20s %10s %10s", "case", "MB/s", "ns/block");
+  if (usePerf)
+    printf(" %10s %10s %10s %8s %10s %10s", "cyc/byte", "cyc/block",
+           "ins/block", "IPC", "L1Dm/block", "brm/block");
+  printf("\n");
+
+  for (size_t c = 0; c < sizeof(CASES) / sizeof(CASES[0]); c++) {
+    uint64_t values[NUM_COUNTERS];
+    CASES[c].run(buf, len, &schedule); /* warm up caches and the key cache */
+
+    if (usePerf)
+      perfStart(&counters);
+    uint64_t start = now();
+    for (long r = 0; r < reps; r++) {
+      CASES[c].run(buf, len, &schedule);
+    }
+    uint64_t elapsed = now() - start;
+    if (usePerf)
+      perfStop(&counters, values);
+
+    printf("%-20s %10.2f %10.1f", CASES[c].name, bytes / elapsed * 1e3,
+           elapsed / blocks);
+    if (usePerf) {
+      /* a dash marks a counter that couldn't be opened */
+      if (perfAvailable(&counters, CTR_CYCLES))
+        printf(" %10.2f %10.1f", values[CTR_CYCLES] / bytes,
+               values[CTR_CYCLES] / blocks);
+      else
+        printf(" %10s %10s", "-", "-");
+      if (perfAvailable(&counters, CTR_INSTRUCTIONS))
+        printf(" %10.1f", values[CTR_INSTRUCTIONS] / blocks);
+      else
+        printf(" %10s", "-");
+      if (values[CTR_CYCLES] > 0 && perfAvailable(&counters, CTR_INSTRUCTIONS))
+        printf(" %8.2f",
+               (double)values[CTR_INSTRUCTIONS] / values[CTR_CYCLES]);
+      else
+        printf(" %8s", "-");
+      if (perfAvailable(&counters, CTR_L1D_MISSES))
+        printf(" %10.3f", values[CTR_L1D_MISSES] / blocks);
+      else
+        printf(" %10s", "-");
+      if (perfAvailable(&counters, CTR_BRANCH_MISSES))
+        printf(" %10.3f", values[CTR_BRANCH_MISSES] / blocks);
+      else
+        printf(" %10s", "-");
+    }
+    printf("\n");
+  }
+
+  if (usePerf)
+    perfClose(&counters);
+  wipe((uint8_t *)&schedule, sizeof(schedule));
+  keyCacheClear();
+  free(buf);
+  exit(EXIT_SUCCESS);
+}
+
+void benchEncrypt(uint8_t buf[], size_t len, const KeySchedule *schedule) {
+  for (size_t i = 0; i < len; i += BLOCK_SIZE) {
+    encryptBlock(&buf[i], schedule);
+  }
+}
+
+void benchDecrypt(uint8_t buf[], size_t len, const KeySchedule *schedule) {
+  for (size_t i = 0; i < len; i += BLOCK_SIZE) {
+    decryptBlock(&buf[i], schedule);
+  }
+}
+
+/* the public per-block API with one key, which reuses the thread's schedule */
+void benchLibrary(uint8_t buf[], size_t len, const KeySchedule *schedule) {
+  (void)schedule;
+  for (size_t i = 0; i < len; i += BLOCK_SIZE) {
+    encrypt(&buf[i], KEY);
+  }
+}
+
+/* the public per-block API with a new key every block, so each is a lookup */
+void benchCached(uint8_t buf[], size_t len, const KeySchedule *schedule) {
+  (void)schedule;
+  for (size_t i = 0; i < len; i += BLOCK_SIZE) {
+    encrypt(&buf[i], KEYS[(i / BLOCK_SIZE) % NUM_KEYS]);
+  }
+}
+
+/* one key expansion per block, each block used as a key */
+void benchExpand(uint8_t buf[], size_t len, const KeySchedule *schedule) {
+  KeySchedule expanded;
+  (void)schedule;
+  for (size_t i = 0; i < len; i += BLOCK_SIZE) {
+    expandKey(&buf[i], &expanded);
+  }
+  wipe((uint8_t *)&expanded, sizeof(expanded));
+}
+
+void benchCheckPad(uint8_t buf[], size_t len, const KeySchedule *schedule) {
+  volatile uint8_t sink = 0; /* keeps the calls from being optimized away */
+  (void)schedule;
+  for (size_t i = 0; i < len; i += BLOCK_SIZE) {
+    sink ^= checkPad(&buf[i]);
+  }
+}
+
+uint64_t now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000u) + (uint64_t)ts.tv_nsec;
+}
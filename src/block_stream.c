@@ -0,0 +1,600 @@
+/**
+ * @file block_stream.c
+ * @brief Implements block streams and their backends
+ *
+ * Every backend supplies its own read, write, positioned read, positioned write
+ * and close functions through a table of function pointers, and the public
+ * functions just dispatch through it. A backend that can't write, like a memory
+ * mapped file, fails writes, and one that can't read fails reads. The stdio
+ * and direct I/O backends have no positioned calls, since stdio keeps its own
+ * file position and direct I/O needs aligned offsets.
+ *
+ * @author Ali Zaheer
+ */
+
+/**
+ * for mmap and friends, with 64-bit offsets on 32-bit hosts, and for O_DIRECT
+ * and fallocate on Linux
+ */
+#define _GNU_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
+/* -- Includes -- */
+#include "block_stream.h" /* for public function prototypes */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h> /* for memcpy */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* systems without direct I/O just go through the page cache */
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+
+typedef struct {
+  int64_t (*read)(BlockStream *stream, uint8_t buf[], size_t len);
+  bool (*write)(BlockStream *stream, uint8_t buf[], size_t len);
+  int64_t (*pread)(BlockStream *stream, uint8_t buf[], size_t len,
+                   uint64_t offset);
+  bool (*pwrite)(BlockStream *stream, uint8_t buf[], size_t len,
+                 uint64_t offset);
+  bool (*close)(BlockStream *stream);
+} StreamOps;
+
+struct BlockStream {
+  const StreamOps *ops;
+  FILE *fp;       /* stdio backend */
+  int fd;         /* file descriptor and mmap backends */
+  uint8_t *bytes; /* mmap and memory backends */
+  size_t len;     /* bytes available for reading */
+  size_t cap;     /* room for writing */
+  size_t pos;     /* next byte to read or write */
+  uint8_t *pool;  /* direct backend: aligned staging buffer */
+  size_t fill;    /* bytes staged in the pool */
+  size_t used;    /* staged bytes already handed to the reader */
+  uint64_t offset; /* direct backend: bytes moved to or from the file */
+  bool failed;     /* a read or write has failed */
+};
+
+/* Local functions */
+static BlockStream *newStream(const StreamOps *ops);
+static int64_t fileRead(BlockStream *stream, uint8_t buf[], size_t len);
+static bool fileWrite(BlockStream *stream, uint8_t buf[], size_t len);
+static bool fileClose(BlockStream *stream);
+static int64_t fdRead(BlockStream *stream, uint8_t buf[], size_t len);
+static bool fdWrite(BlockStream *stream, uint8_t buf[], size_t len);
+static bool fdClose(BlockStream *stream);
+static int64_t memoryRead(BlockStream *stream, uint8_t buf[], size_t len);
+static bool memoryWrite(BlockStream *stream, uint8_t buf[], size_t len);
+static bool memoryClose(BlockStream *stream);
+static int64_t noRead(BlockStream *stream, uint8_t buf[], size_t len);
+static bool noWrite(BlockStream *stream, uint8_t buf[], size_t len);
+static int64_t fdPread(BlockStream *stream, uint8_t buf[], size_t len,
+                       uint64_t offset);
+static bool fdPwrite(BlockStream *stream, uint8_t buf[], size_t len,
+                     uint64_t offset);
+static int64_t memoryPread(BlockStream *stream, uint8_t buf[], size_t len,
+                           uint64_t offset);
+static bool memoryPwrite(BlockStream *stream, uint8_t buf[], size_t len,
+                         uint64_t offset);
+static int64_t noPread(BlockStream *stream, uint8_t buf[], size_t len,
+                       uint64_t offset);
+static bool noPwrite(BlockStream *stream, uint8_t buf[], size_t len,
+                     uint64_t offset);
+static int fdOf(BlockStream *stream);
+static bool mmapClose(BlockStream *stream);
+static BlockStream *openDirect(char *path, int flags);
+static int64_t directRead(BlockStream *stream, uint8_t buf[], size_t len);
+static bool directWrite(BlockStream *stream, uint8_t buf[], size_t len);
+static bool directFlush(BlockStream *stream, size_t len);
+static bool directReadClose(BlockStream *stream);
+static bool directWriteClose(BlockStream *stream);
+static bool isAligned(uint8_t buf[], size_t len);
+
+static const StreamOps FILE_OPS = {fileRead, fileWrite, noPread, noPwrite,
+                                   fileClose};
+static const StreamOps FD_OPS = {fdRead, fdWrite, fdPread, fdPwrite, fdClose};
+static const StreamOps MMAP_OPS = {memoryRead, noWrite, memoryPread, noPwrite,
+                                   mmapClose};
+static const StreamOps MEMORY_OPS = {memoryRead, memoryWrite, memoryPread,
+                                     memoryPwrite, memoryClose};
+static const StreamOps DIRECT_READ_OPS = {directRead, noWrite, noPread,
+                                          noPwrite, directReadClose};
+static const StreamOps DIRECT_WRITE_OPS = {noRead, directWrite, noPread,
+                                           noPwrite, directWriteClose};
+
+BlockStream *streamFromFile(FILE *fp) {
+  BlockStream *stream = newStream(&FILE_OPS);
+  if (stream != NULL)
+    stream->fp = fp;
+  return stream;
+}
+
+BlockStream *streamFromFd(int fd) {
+  BlockStream *stream = newStream(&FD_OPS);
+  if (stream != NULL)
+    stream->fd = fd;
+  return stream;
+}
+
+/* the kernel is told the map will be read front to back, for read-ahead */
+BlockStream *streamFromMmap(char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  /* files too big for the address space are left to the fd backend */
+  struct stat info;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0 &&
+      (uint64_t)info.st_size <= SIZE_MAX)
+    map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  BlockStream *stream = (map != MAP_FAILED) ? newStream(&MMAP_OPS) : NULL;
+  if (stream == NULL) {
+    if (map != MAP_FAILED)
+      munmap(map, (size_t)info.st_size);
+    close(fd);
+    return NULL;
+  }
+  posix_madvise(map, (size_t)info.st_size, POSIX_MADV_SEQUENTIAL);
+  stream->fd = fd;
+  stream->bytes = (uint8_t *)map;
+  stream->len = (size_t)info.st_size;
+  return stream;
+}
+
+BlockStream *streamFromMemory(uint8_t bytes[], size_t len, size_t cap) {
+  BlockStream *stream = newStream(&MEMORY_OPS);
+  if (stream != NULL) {
+    stream->bytes = bytes;
+    stream->len = len;
+    stream->cap = cap;
+  }
+  return stream;
+}
+
+BlockStream *streamOpenRead(char *path, bool map) {
+  BlockStream *stream = map ? streamFromMmap(path) : NULL;
+  if (stream != NULL)
+    return stream;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if ((stream = streamFromFd(fd)) == NULL)
+    close(fd);
+  return stream;
+}
+
+BlockStream *streamOpenWrite(char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return NULL;
+  BlockStream *stream = streamFromFd(fd);
+  if (stream == NULL)
+    close(fd);
+  return stream;
+}
+
+/* the file isn't truncated, so it can be changed in place */
+BlockStream *streamOpenUpdate(char *path) {
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    return NULL;
+  BlockStream *stream = streamFromFd(fd);
+  if (stream == NULL)
+    close(fd);
+  return stream;
+}
+
+BlockStream *streamOpenDirectRead(char *path, uint64_t *size) {
+  BlockStream *stream = openDirect(path, O_RDONLY);
+  struct stat info;
+  if (stream != NULL && fstat(stream->fd, &info) != 0) {
+    streamClose(stream);
+    return NULL;
+  }
+  if (stream != NULL) {
+    stream->ops = &DIRECT_READ_OPS;
+    *size = (uint64_t)info.st_size;
+  }
+  return stream;
+}
+
+/* preallocation is only a hint, so a file system without it is no error */
+BlockStream *streamOpenDirectWrite(char *path, uint64_t size) {
+  BlockStream *stream = openDirect(path, O_WRONLY | O_CREAT | O_TRUNC);
+  if (stream != NULL) {
+    stream->ops = &DIRECT_WRITE_OPS;
+#ifdef __linux__
+    if (size > 0)
+      fallocate(stream->fd, 0, 0, (off_t)size);
+#else
+    (void)size;
+#endif
+  }
+  return stream;
+}
+
+uint8_t *streamBuffer(size_t len) {
+  size_t rounded = (len + STREAM_ALIGN - 1) / STREAM_ALIGN * STREAM_ALIGN;
+  void *buf = NULL;
+  if (posix_memalign(&buf, STREAM_ALIGN, rounded) != 0)
+    return NULL;
+  return (uint8_t *)buf;
+}
+
+int64_t streamRead(BlockStream *stream, uint8_t buf[], size_t len) {
+  int64_t bytes = stream->ops->read(stream, buf, len);
+  if (bytes < 0)
+    stream->failed = true;
+  return bytes;
+}
+
+bool streamWrite(BlockStream *stream, uint8_t buf[], size_t len) {
+  bool ok = stream->ops->write(stream, buf, len);
+  if (!ok)
+    stream->failed = true;
+  return ok;
+}
+
+size_t streamWritten(BlockStream *stream) {
+  return (stream->ops == &MEMORY_OPS) ? stream->pos : 0;
+}
+
+int64_t streamPread(BlockStream *stream, uint8_t buf[], size_t len,
+                    uint64_t offset) {
+  int64_t bytes = stream->ops->pread(stream, buf, len, offset);
+  if (bytes < 0)
+    stream->failed = true;
+  return bytes;
+}
+
+bool streamPwrite(BlockStream *stream, uint8_t buf[], size_t len,
+                  uint64_t offset) {
+  bool ok = stream->ops->pwrite(stream, buf, len, offset);
+  if (!ok)
+    stream->failed = true;
+  return ok;
+}
+
+bool streamStat(BlockStream *stream, struct stat *info) {
+  int fd = fdOf(stream);
+  return fd >= 0 && fstat(fd, info) == 0;
+}
+
+bool streamTruncate(BlockStream *stream, uint64_t size) {
+  int fd = fdOf(stream);
+  return fd >= 0 && ftruncate(fd, (off_t)size) == 0;
+}
+
+bool streamSync(BlockStream *stream) {
+  if (stream->fp != NULL && fflush(stream->fp) != 0)
+    return false;
+  int fd = fdOf(stream);
+  return fd >= 0 && fsync(fd) == 0;
+}
+
+bool streamSyncDir(char *path) {
+  char *slash = strrchr(path, '/');
+  size_t dirLen = (slash == NULL) ? 0 : (size_t)(slash - path);
+  char *dir = (char *)malloc(dirLen + 2);
+  if (dir == NULL)
+    return false;
+  if (slash == NULL) {
+    memcpy(dir, ".", 2);
+  } else if (dirLen == 0) {
+    memcpy(dir, "/", 2);
+  } else {
+    memcpy(dir, path, dirLen);
+    dir[dirLen] = '\0';
+  }
+
+  int fd = open(dir, O_RDONLY);
+  bool ok = (fd >= 0) && (fsync(fd) == 0);
+  if (fd >= 0)
+    close(fd);
+  free(dir);
+  return ok;
+}
+
+bool streamFailed(BlockStream *stream) { return stream->failed; }
+
+bool streamClose(BlockStream *stream) {
+  bool ok = stream->ops->close(stream);
+  free(stream->pool);
+  free(stream);
+  return ok;
+}
+
+BlockStream *newStream(const StreamOps *ops) {
+  BlockStream *stream = (BlockStream *)calloc(1, sizeof(BlockStream));
+  if (stream != NULL) {
+    stream->ops = ops;
+    stream->fd = -1;
+  }
+  return stream;
+}
+
+int64_t fileRead(BlockStream *stream, uint8_t buf[], size_t len) {
+  size_t bytes = fread(buf, sizeof(uint8_t), len, stream->fp);
+  return ferror(stream->fp) ? -1 : (int64_t)bytes;
+}
+
+bool fileWrite(BlockStream *stream, uint8_t buf[], size_t len) {
+  return fwrite(buf, sizeof(uint8_t), len, stream->fp) == len;
+}
+
+bool fileClose(BlockStream *stream) { return fclose(stream->fp) == 0; }
+
+/* read may return less than asked before the end, so it is retried */
+int64_t fdRead(BlockStream *stream, uint8_t buf[], size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = read(stream->fd, &buf[done], len - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -1;
+    if (n == 0)
+      break;
+    done += (size_t)n;
+  }
+  return (int64_t)done;
+}
+
+bool fdWrite(BlockStream *stream, uint8_t buf[], size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = write(stream->fd, &buf[done], len - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    done += (size_t)n;
+  }
+  return true;
+}
+
+/* pread and pwrite may transfer less than asked, so they are retried */
+int64_t fdPread(BlockStream *stream, uint8_t buf[], size_t len,
+                uint64_t offset) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pread(stream->fd, &buf[done], len - done,
+                      (off_t)(offset + done));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -1;
+    if (n == 0)
+      break;
+    done += (size_t)n;
+  }
+  return (int64_t)done;
+}
+
+bool fdPwrite(BlockStream *stream, uint8_t buf[], size_t len,
+              uint64_t offset) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pwrite(stream->fd, &buf[done], len - done,
+                       (off_t)(offset + done));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    done += (size_t)n;
+  }
+  return true;
+}
+
+bool fdClose(BlockStream *stream) { return close(stream->fd) == 0; }
+
+int64_t memoryRead(BlockStream *stream, uint8_t buf[], size_t len) {
+  size_t bytes = stream->len - stream->pos;
+  if (bytes > len)
+    bytes = len;
+  if (bytes == 0)
+    return 0;
+  memcpy(buf, &stream->bytes[stream->pos], bytes);
+  stream->pos += bytes;
+  return (int64_t)bytes;
+}
+
+bool memoryWrite(BlockStream *stream, uint8_t buf[], size_t len) {
+  if (len > stream->cap - stream->pos)
+    return false;
+  memcpy(&stream->bytes[stream->pos], buf, len);
+  stream->pos += len;
+  return true;
+}
+
+int64_t memoryPread(BlockStream *stream, uint8_t buf[], size_t len,
+                    uint64_t offset) {
+  if (offset >= stream->len)
+    return 0;
+  size_t bytes = stream->len - (size_t)offset;
+  if (bytes > len)
+    bytes = len;
+  memcpy(buf, &stream->bytes[offset], bytes);
+  return (int64_t)bytes;
+}
+
+/* bytes written so far run up to the furthest write */
+bool memoryPwrite(BlockStream *stream, uint8_t buf[], size_t len,
+                  uint64_t offset) {
+  if (offset > stream->cap || len > stream->cap - (size_t)offset)
+    return false;
+  memcpy(&stream->bytes[offset], buf, len);
+  if ((size_t)offset + len > stream->pos)
+    stream->pos = (size_t)offset + len;
+  return true;
+}
+
+bool memoryClose(BlockStream *stream) {
+  (void)stream;
+  return true;
+}
+
+int64_t noRead(BlockStream *stream, uint8_t buf[], size_t len) {
+  (void)stream;
+  (void)buf;
+  (void)len;
+  return -1;
+}
+
+bool noWrite(BlockStream *stream, uint8_t buf[], size_t len) {
+  (void)stream;
+  (void)buf;
+  (void)len;
+  return false;
+}
+
+int64_t noPread(BlockStream *stream, uint8_t buf[], size_t len,
+                uint64_t offset) {
+  (void)offset;
+  return noRead(stream, buf, len);
+}
+
+bool noPwrite(BlockStream *stream, uint8_t buf[], size_t len,
+              uint64_t offset) {
+  (void)offset;
+  return noWrite(stream, buf, len);
+}
+
+/* the descriptor under the stream, or -1 for memory */
+int fdOf(BlockStream *stream) {
+  return (stream->fp != NULL) ? fileno(stream->fp) : stream->fd;
+}
+
+bool mmapClose(BlockStream *stream) {
+  munmap(stream->bytes, stream->len);
+  return close(stream->fd) == 0;
+}
+
+/* file systems that refuse O_DIRECT, like tmpfs, are opened without it */
+BlockStream *openDirect(char *path, int flags) {
+  int fd = open(path, flags | O_DIRECT, 0644);
+  if (fd < 0 && errno == EINVAL)
+    fd = open(path, flags, 0644);
+  if (fd < 0)
+    return NULL;
+
+  BlockStream *stream = streamFromFd(fd);
+  if (stream == NULL || (stream->pool = streamBuffer(STREAM_CHUNK)) == NULL) {
+    if (stream != NULL)
+      free(stream);
+    close(fd);
+    return NULL;
+  }
+  return stream;
+}
+
+/**
+ * Whole aligned reads skip the pool. Every read of the file itself is
+ * STREAM_ALIGN sized until the end of the file, so its offset stays aligned.
+ */
+int64_t directRead(BlockStream *stream, uint8_t buf[], size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    if (stream->used == stream->fill) {
+      int64_t n;
+      if (isAligned(&buf[done], len - done)) {
+        n = fdRead(stream, &buf[done], len - done);
+        if (n < 0)
+          return -1;
+        stream->offset += (uint64_t)n;
+        done += (size_t)n;
+        break;
+      }
+      if ((n = fdRead(stream, stream->pool, STREAM_CHUNK)) <= 0) {
+        if (n < 0)
+          return -1;
+        break;
+      }
+      stream->offset += (uint64_t)n;
+      stream->fill = (size_t)n;
+      stream->used = 0;
+    }
+    size_t bytes = stream->fill - stream->used;
+    if (bytes > len - done)
+      bytes = len - done;
+    memcpy(&buf[done], &stream->pool[stream->used], bytes);
+    stream->used += bytes;
+    done += bytes;
+  }
+  return (int64_t)done;
+}
+
+/**
+ * Unaligned writes are collected in the pool and written once it is full. An
+ * aligned buffer goes straight to the file up to its last whole STREAM_ALIGN
+ * unit, so only the remainder of a final short write is copied.
+ */
+bool directWrite(BlockStream *stream, uint8_t buf[], size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    size_t whole = (len - done) / STREAM_ALIGN * STREAM_ALIGN;
+    if (stream->fill == 0 && whole > 0 && isAligned(&buf[done], whole)) {
+      if (!fdWrite(stream, &buf[done], whole))
+        return false;
+      stream->offset += (uint64_t)whole;
+      done += whole;
+      continue;
+    }
+    size_t bytes = STREAM_CHUNK - stream->fill;
+    if (bytes > len - done)
+      bytes = len - done;
+    memcpy(&stream->pool[stream->fill], &buf[done], bytes);
+    stream->fill += bytes;
+    done += bytes;
+    if (stream->fill == STREAM_CHUNK && !directFlush(stream, STREAM_CHUNK))
+      return false;
+  }
+  return true;
+}
+
+/* writes the first len bytes of the pool and keeps the rest */
+bool directFlush(BlockStream *stream, size_t len) {
+  if (!fdWrite(stream, stream->pool, len))
+    return false;
+  stream->offset += (uint64_t)len;
+  memmove(stream->pool, &stream->pool[len], stream->fill - len);
+  stream->fill -= len;
+  return true;
+}
+
+bool directReadClose(BlockStream *stream) {
+  posix_fadvise(stream->fd, 0, 0, POSIX_FADV_DONTNEED);
+  return close(stream->fd) == 0;
+}
+
+/**
+ * Direct writes must be whole STREAM_ALIGN units, so the last partial unit is
+ * written through the page cache after turning O_DIRECT off. The file is then
+ * cut back from its preallocated size, and its cached pages are dropped once
+ * they have been written back.
+ */
+bool directWriteClose(BlockStream *stream) {
+  size_t aligned = stream->fill / STREAM_ALIGN * STREAM_ALIGN;
+  bool ok = (aligned == 0) || directFlush(stream, aligned);
+  if (ok && stream->fill > 0) {
+    int flags = fcntl(stream->fd, F_GETFL);
+    ok = (flags >= 0) && (fcntl(stream->fd, F_SETFL, flags & ~O_DIRECT) == 0) &&
+         directFlush(stream, stream->fill);
+  }
+  ok = ok && (ftruncate(stream->fd, (off_t)stream->offset) == 0);
+  ok = ok && (fdatasync(stream->fd) == 0);
+  posix_fadvise(stream->fd, 0, 0, POSIX_FADV_DONTNEED);
+  return (close(stream->fd) == 0) && ok;
+}
+
+bool isAligned(uint8_t buf[], size_t len) {
+  return ((uintptr_t)buf % STREAM_ALIGN) == 0 && (len % STREAM_ALIGN) == 0;
+}
@@ -0,0 +1,274 @@
+/**
+ * @file block_stream.h
+ * @brief Function prototypes for block streams
+ *
+ * A block stream moves bytes in and out of the cipher. The file modes move
+ * whole blocks, but the streams themselves take any number of bytes. All of its
+ * state lives in the stream object, so any number of streams can be
+ * open at once and each one can be used by a different thread. Where the bytes
+ * come from or go to is up to the backend:
+ * 1. stdio FILE
+ * 2. File descriptor, using large read and write calls
+ * 3. Memory mapped file, read-only
+ * 4. In-memory buffer
+ * 5. Direct I/O that bypasses the page cache, for very large files
+ *
+ * @author Ali Zaheer
+ */
+
+#ifndef BLOCK_STREAM_H
+#define BLOCK_STREAM_H
+
+/* -- Includes -- */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h> /* for struct stat */
+
+#define STREAM_CHUNK 65536 /* bytes moved per call by the file modes */
+#define STREAM_ALIGN 4096  /* alignment of buffers and offsets for direct I/O */
+
+typedef struct BlockStream BlockStream;
+
+/**
+ * @brief Wraps an open stdio FILE.
+ *
+ * @param fp The FILE, which is closed along with the stream
+ *
+ * @return The stream, or NULL if out of memory
+ */
+BlockStream *streamFromFile(FILE *fp);
+
+/**
+ * @brief Wraps an open file descriptor.
+ *
+ * @param fd The file descriptor, which is closed along with the stream
+ *
+ * @return The stream, or NULL if out of memory
+ */
+BlockStream *streamFromFd(int fd);
+
+/**
+ * @brief Maps a whole file into memory for reading.
+ *
+ * @param path Path of the file
+ *
+ * @return The stream, or NULL if the file can't be mapped
+ */
+BlockStream *streamFromMmap(char *path);
+
+/**
+ * @brief Reads from or writes to a buffer in memory.
+ *
+ * Reads start at the beginning of the buffer and stop after len bytes. Writes
+ * also start at the beginning, and fail once they would go past cap bytes.
+ *
+ * @param bytes The buffer, which stays owned by the caller
+ * @param len Number of bytes available for reading
+ * @param cap Size of the buffer for writing
+ *
+ * @return The stream, or NULL if out of memory
+ */
+BlockStream *streamFromMemory(uint8_t bytes[], size_t len, size_t cap);
+
+/**
+ * @brief Opens a file for reading.
+ *
+ * Regular files are memory mapped if map is set. Anything else, like a pipe or
+ * an empty file, is read through its file descriptor.
+ *
+ * @param path Path of the file
+ * @param map Whether to memory map the file when possible
+ *
+ * @return The stream, or NULL if the file can't be opened
+ */
+BlockStream *streamOpenRead(char *path, bool map);
+
+/**
+ * @brief Creates or truncates a file for writing.
+ *
+ * @param path Path of the file
+ *
+ * @return The stream, or NULL if the file can't be opened
+ */
+BlockStream *streamOpenWrite(char *path);
+
+/**
+ * @brief Opens a file for reading and writing in place.
+ *
+ * The file is created if it doesn't exist, and is not truncated. Meant for the
+ * positioned calls.
+ *
+ * @param path Path of the file
+ *
+ * @return The stream, or NULL if the file can't be opened
+ */
+BlockStream *streamOpenUpdate(char *path);
+
+/**
+ * @brief Opens a file for reading with direct I/O.
+ *
+ * The file is read with O_DIRECT where the system supports it, so a single pass
+ * over a huge file doesn't push everything else out of the page cache. Reads
+ * into a buffer from streamBuffer() of a multiple of STREAM_ALIGN bytes go
+ * straight to the caller, and other reads are staged in an aligned buffer owned
+ * by the stream. The cache is told the file won't be needed again when the
+ * stream is closed.
+ *
+ * @param path Path of the file
+ * @param size Set to the size of the file in bytes
+ *
+ * @return The stream, or NULL if the file can't be opened
+ */
+BlockStream *streamOpenDirectRead(char *path, uint64_t *size);
+
+/**
+ * @brief Creates or truncates a file for writing with direct I/O.
+ *
+ * Works like streamOpenDirectRead() for writes. The file is preallocated to
+ * size bytes up front, so it isn't extended one write at a time, and is cut
+ * back to the number of bytes actually written when the stream is closed.
+ *
+ * @param path Path of the file
+ * @param size Expected size of the file in bytes, or 0 if unknown
+ *
+ * @return The stream, or NULL if the file can't be opened
+ */
+BlockStream *streamOpenDirectWrite(char *path, uint64_t size);
+
+/**
+ * @brief Allocates a buffer suitable for direct I/O.
+ *
+ * @param len Size of the buffer in bytes
+ *
+ * @return Buffer aligned to STREAM_ALIGN, to be released with free(), or NULL
+ * if out of memory
+ */
+uint8_t *streamBuffer(size_t len);
+
+/**
+ * @brief Reads the next bytes of the stream.
+ *
+ * Fewer than len bytes are only returned at the end of the stream, so a short
+ * read means the next one will return 0.
+ *
+ * @param stream The stream
+ * @param buf Array to store the bytes in
+ * @param len Number of bytes to read, normally a multiple of BLOCK_SIZE
+ *
+ * @return Number of bytes read, or -1 if there was a read error
+ */
+int64_t streamRead(BlockStream *stream, uint8_t buf[], size_t len);
+
+/**
+ * @brief Writes bytes to the stream.
+ *
+ * @param stream The stream
+ * @param buf The bytes
+ * @param len Number of bytes to write
+ *
+ * @return True if every byte was written, otherwise false
+ */
+bool streamWrite(BlockStream *stream, uint8_t buf[], size_t len);
+
+/**
+ * @brief Reads bytes at an offset, without moving the stream's position.
+ *
+ * Fewer than len bytes are only returned when the end of the stream is
+ * reached. The stdio and direct I/O backends don't support it and always fail.
+ *
+ * @param stream The stream
+ * @param buf Array to store the bytes in
+ * @param len Number of bytes to read
+ * @param offset Offset of the first byte from the start of the stream
+ *
+ * @return Number of bytes read, or -1 if there was a read error
+ */
+int64_t streamPread(BlockStream *stream, uint8_t buf[], size_t len,
+                    uint64_t offset);
+
+/**
+ * @brief Writes bytes at an offset, without moving the stream's position.
+ *
+ * Supported by the same backends as streamPread(), where they can write.
+ *
+ * @param stream The stream
+ * @param buf The bytes
+ * @param len Number of bytes to write
+ * @param offset Offset of the first byte from the start of the stream
+ *
+ * @return True if every byte was written, otherwise false
+ */
+bool streamPwrite(BlockStream *stream, uint8_t buf[], size_t len,
+                  uint64_t offset);
+
+/**
+ * @brief Gets the status of the file under the stream, like fstat.
+ *
+ * @param stream The stream
+ * @param info Struct to store the status in
+ *
+ * @return True if successful, false for memory streams or on error
+ */
+bool streamStat(BlockStream *stream, struct stat *info);
+
+/**
+ * @brief Cuts or extends the file under the stream to a size.
+ *
+ * @param stream The stream
+ * @param size New size in bytes
+ *
+ * @return True if successful, false for memory streams or on error
+ */
+bool streamTruncate(BlockStream *stream, uint64_t size);
+
+/**
+ * @brief Flushes the stream and syncs its file to storage.
+ *
+ * @param stream The stream
+ *
+ * @return True if successful, false for memory streams or on error
+ */
+bool streamSync(BlockStream *stream);
+
+/**
+ * @brief Syncs the directory holding a file, so a rename within it is durable.
+ *
+ * @param path Path of the file
+ *
+ * @return True if successful, otherwise false
+ */
+bool streamSyncDir(char *path);
+
+/**
+ * @brief Gives the number of bytes written to a memory stream.
+ *
+ * @param stream The stream
+ *
+ * @return Bytes written so far, or 0 for other backends
+ */
+size_t streamWritten(BlockStream *stream);
+
+/**
+ * @brief Tells whether a read or write of the stream, positioned or not, has
+ * failed.
+ *
+ * Lets a caller that only saw its processing fail tell an I/O error on either
+ * side apart from invalid input.
+ *
+ * @param stream The stream
+ *
+ * @return True if any read or write failed, otherwise false
+ */
+bool streamFailed(BlockStream *stream);
+
+/**
+ * @brief Closes the stream and what it wraps.
+ *
+ * @param stream The stream
+ *
+ * @return True if everything was flushed and closed, otherwise false
+ */
+bool streamClose(BlockStream *stream);
+
+#endif
@@ -10,6 +10,7 @@
 #include "byte_ops.h" /* For public function prototypes */
 #include <ctype.h>    /* For char functions */
 #include <stdio.h>
+#include <string.h> /* For memcpy */
 
 /* Local function */
 static uint8_t hexToByte(char A, char B);
@@ -31,6 +32,14 @@ void copy(uint8_t dest[], size_t d_off, uint8_t source[], size_t s_off,
   }
 }
 
+/* writes go through a volatile pointer so the compiler must keep them */
+void wipe(uint8_t bytes[], size_t length) {
+  volatile uint8_t *p = bytes;
+  for (size_t i = 0; i < length; i++) {
+    p[i] = 0;
+  }
+}
+
 /* The transposed matrix will be n x m. It will have entries (i , j).
  * (i * m) + j is the j-th element in i-th row, where each row has m entries.
  */
@@ -107,8 +116,21 @@ uint8_t multiply(uint8_t a, uint8_t b) {
   return result;
 }
 
+/**
+ * XORs 8 bytes at a time, then finishes any remaining bytes one at a time.
+ * memcpy is used for the wide loads and stores since the arrays might not be
+ * aligned; compilers turn it into single 64-bit moves.
+ */
 uint8_t *arrXor(uint8_t a[], uint8_t b[], size_t length) {
-  for (size_t i = 0; i < length; i++) {
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+    uint64_t x, y;
+    memcpy(&x, &a[i], sizeof(uint64_t));
+    memcpy(&y, &b[i], sizeof(uint64_t));
+    x ^= y;
+    memcpy(&a[i], &x, sizeof(uint64_t));
+  }
+  for (; i < length; i++) {
     a[i] = a[i] ^ b[i];
   }
   return a;
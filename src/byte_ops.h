@@ -54,6 +54,17 @@ uint8_t *slice(uint8_t array[], size_t start, size_t end, size_t step);
  */
 void copy(uint8_t dest[], size_t d, uint8_t source[], size_t s, size_t length);
 
+/**
+ * @brief Overwrites an array with zeros
+ *
+ * Unlike a plain loop, the stores can't be optimized away even if the array is
+ * never read again. Used to clear key material.
+ *
+ * @param bytes The array of bytes
+ * @param length Array length
+ */
+void wipe(uint8_t bytes[], size_t length);
+
 /**
  * @brief Transposes a matrix, represented by a linear array, and stores the
  * result in another array
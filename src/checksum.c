@@ -0,0 +1,157 @@
+/**
+ * @file checksum.c
+ * @brief Implements the CRC32C checksums of the file modes
+ *
+ * CRC32C uses the reflected Castagnoli polynomial 0x82F63B78, starting from
+ * all ones and inverting the result, as in iSCSI and ext4. The lookup table
+ * and the check for the CRC32 instruction are done once, the first time a
+ * checksum is computed.
+ *
+ * @author Ali Zaheer
+ */
+
+/* for fileno and fsync */
+#define _POSIX_C_SOURCE 200809L
+
+/* -- Includes -- */
+#include "checksum.h"     /* for public function prototypes */
+#include "block_stream.h" /* for syncing the directory after the rename */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>  /* for memcpy */
+#include <threads.h> /* for call_once */
+#include <unistd.h>  /* for fsync */
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h> /* for _mm_crc32_u64 */
+#define HAVE_SSE42_CRC 1
+#endif
+
+#define POLY 0x82F63B78u
+#define SUFFIX ".crc32c"
+
+static uint32_t table[256];
+static bool hardware;
+static once_flag initFlag = ONCE_FLAG_INIT;
+
+/* Local functions */
+static void initCrc(void);
+static uint32_t tableCrc(uint32_t crc, const uint8_t bytes[], size_t len);
+#ifdef HAVE_SSE42_CRC
+static uint32_t hardwareCrc(uint32_t crc, const uint8_t bytes[], size_t len);
+#endif
+static char *checksumPath(char *dataPath);
+
+uint32_t crc32c(uint32_t crc, const uint8_t bytes[], size_t len) {
+  call_once(&initFlag, initCrc);
+  crc = ~crc;
+#ifdef HAVE_SSE42_CRC
+  if (hardware)
+    return ~hardwareCrc(crc, bytes, len);
+#endif
+  return ~tableCrc(crc, bytes, len);
+}
+
+/**
+ * The checksum file is written to a temporary file, synced and renamed over
+ * the old one, and the rename is synced through the directory, like the update
+ * manifest. A crash leaves either the old checksums or the new ones, never a
+ * torn file that fails every later check.
+ */
+bool digestsSave(char *dataPath, const Digests *digests) {
+  char *path = checksumPath(dataPath);
+  if (path == NULL)
+    return false;
+  size_t pathLen = strlen(path);
+  char *tempPath = (char *)malloc(pathLen + sizeof(".tmp"));
+  if (tempPath == NULL) {
+    free(path);
+    return false;
+  }
+  memcpy(tempPath, path, pathLen);
+  memcpy(&tempPath[pathLen], ".tmp", sizeof(".tmp"));
+
+  FILE *fp = fopen(tempPath, "w");
+  bool ok = (fp != NULL);
+  if (ok) {
+    ok = fprintf(fp, "crc32c plaintext %08lx %llu\n",
+                 (unsigned long)digests->plain,
+                 (unsigned long long)digests->plainLen) > 0;
+    ok = ok && fprintf(fp, "crc32c ciphertext %08lx %llu\n",
+                       (unsigned long)digests->cipher,
+                       (unsigned long long)digests->cipherLen) > 0;
+    ok = ok && (fflush(fp) == 0) && (fsync(fileno(fp)) == 0);
+    ok = (fclose(fp) == 0) && ok;
+  }
+  ok = ok && (rename(tempPath, path) == 0);
+  if (!ok)
+    remove(tempPath);
+  ok = ok && streamSyncDir(path);
+  free(tempPath);
+  free(path);
+  return ok;
+}
+
+bool digestsLoad(char *dataPath, Digests *digests) {
+  char *path = checksumPath(dataPath);
+  FILE *fp = (path != NULL) ? fopen(path, "r") : NULL;
+  bool ok = (fp != NULL);
+  if (ok) {
+    unsigned long plain, cipher;
+    unsigned long long plainLen, cipherLen;
+    ok = fscanf(fp, "crc32c plaintext %8lx %llu\n", &plain, &plainLen) == 2 &&
+         fscanf(fp, "crc32c ciphertext %8lx %llu", &cipher, &cipherLen) == 2;
+    digests->plain = (uint32_t)plain;
+    digests->cipher = (uint32_t)cipher;
+    digests->plainLen = plainLen;
+    digests->cipherLen = cipherLen;
+    fclose(fp);
+  }
+  free(path);
+  return ok;
+}
+
+void initCrc(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 1) ? (crc >> 1) ^ POLY : crc >> 1;
+    }
+    table[i] = crc;
+  }
+#ifdef HAVE_SSE42_CRC
+  hardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+uint32_t tableCrc(uint32_t crc, const uint8_t bytes[], size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    crc = (crc >> 8) ^ table[(crc ^ bytes[i]) & 0xFF];
+  }
+  return crc;
+}
+
+#ifdef HAVE_SSE42_CRC
+/* eight bytes per instruction, then the leftover bytes from the table */
+__attribute__((target("sse4.2"))) uint32_t
+hardwareCrc(uint32_t crc, const uint8_t bytes[], size_t len) {
+  uint64_t wide = crc;
+  uint64_t word;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    memcpy(&word, &bytes[i], 8);
+    wide = _mm_crc32_u64(wide, word);
+  }
+  return tableCrc((uint32_t)wide, &bytes[i], len - i);
+}
+#endif
+
+char *checksumPath(char *dataPath) {
+  size_t len = strlen(dataPath);
+  char *path = (char *)malloc(len + sizeof(SUFFIX));
+  if (path != NULL) {
+    memcpy(path, dataPath, len);
+    memcpy(&path[len], SUFFIX, sizeof(SUFFIX));
+  }
+  return path;
+}
@@ -0,0 +1,70 @@
+/**
+ * @file checksum.h
+ * @brief Function prototypes for the CRC32C checksums of the file modes
+ *
+ * With checksums on, the file modes compute a CRC32C of the plaintext and of
+ * the ciphertext while the data passes through the cipher, so neither file has
+ * to be read again to get them. Encryption stores both next to the output in a
+ * checksum file, which is the output's name with ".crc32c" appended, and
+ * decryption checks both against the checksum file of its input.
+ *
+ * The checksum file is a text file of two lines:
+ * crc32c plaintext <8 hex digits> <length>
+ * crc32c ciphertext <8 hex digits> <length>
+ *
+ * CRC32C only catches accidental damage. It is no protection against someone
+ * changing the ciphertext on purpose.
+ *
+ * @author Ali Zaheer
+ */
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+/* -- Includes -- */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+  uint32_t plain;
+  uint32_t cipher;
+  uint64_t plainLen;
+  uint64_t cipherLen;
+} Digests;
+
+/**
+ * @brief Extends a CRC32C with more bytes.
+ *
+ * Uses the SSE4.2 CRC32 instruction where the CPU has it, and a lookup table
+ * otherwise. Both give the same result.
+ *
+ * @param crc CRC32C of the bytes before, or 0 to start
+ * @param bytes The bytes
+ * @param len Number of bytes
+ *
+ * @return CRC32C of all the bytes so far
+ */
+uint32_t crc32c(uint32_t crc, const uint8_t bytes[], size_t len);
+
+/**
+ * @brief Writes the checksum file of an encrypted file, replacing it whole.
+ *
+ * @param dataPath Path of the encrypted file
+ * @param digests The checksums
+ *
+ * @return True if the checksum file was written, otherwise false
+ */
+bool digestsSave(char *dataPath, const Digests *digests);
+
+/**
+ * @brief Reads the checksum file of an encrypted file.
+ *
+ * @param dataPath Path of the encrypted file
+ * @param digests Set to the stored checksums
+ *
+ * @return True if the checksum file was read, otherwise false
+ */
+bool digestsLoad(char *dataPath, Digests *digests);
+
+#endif
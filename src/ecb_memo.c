@@ -0,0 +1,83 @@
+/**
+ * @file ecb_memo.c
+ * @brief Implements the ECB repeated block cache
+ *
+ * Blocks are compared with memcmp, and the zero check reads a block as two
+ * 64-bit words. The cache slot for a block comes from a multiplicative hash of
+ * those words, and a new block simply replaces whatever was in its slot.
+ *
+ * @author Ali Zaheer
+ */
+
+/* -- Includes -- */
+#include "ecb_memo.h" /* for public function prototypes */
+#include "byte_ops.h" /* for copy and wipe */
+#include <string.h>   /* for memcpy and memcmp */
+
+/* Local functions */
+static bool isZero(uint8_t block[]);
+static size_t slotFor(uint8_t block[]);
+static void cipher(EcbMemo *memo, uint8_t block[]);
+
+void memoInit(EcbMemo *memo, const KeySchedule *schedule, Direction direction) {
+  memset(memo, 0, sizeof(EcbMemo));
+  memo->schedule = schedule;
+  memo->direction = direction;
+  cipher(memo, memo->zeroOut);
+}
+
+void memoBlocks(EcbMemo *memo, uint8_t bytes[], size_t len) {
+  for (size_t i = 0; i < len; i += BLOCK_SIZE) {
+    uint8_t *block = &bytes[i];
+
+    if (memo->havePrev && memcmp(block, memo->prevIn, BLOCK_SIZE) == 0) {
+      copy(block, 0, memo->prevOut, 0, BLOCK_SIZE);
+      memo->runHits++;
+      continue;
+    }
+    copy(memo->prevIn, 0, block, 0, BLOCK_SIZE);
+    memo->havePrev = true;
+
+    if (isZero(block)) {
+      copy(block, 0, memo->zeroOut, 0, BLOCK_SIZE);
+      memo->zeroHits++;
+    } else {
+      MemoSlot *slot = &memo->slots[slotFor(block)];
+      if (slot->used && memcmp(block, slot->in, BLOCK_SIZE) == 0) {
+        copy(block, 0, slot->out, 0, BLOCK_SIZE);
+        memo->slotHits++;
+      } else {
+        copy(slot->in, 0, block, 0, BLOCK_SIZE);
+        cipher(memo, block);
+        copy(slot->out, 0, block, 0, BLOCK_SIZE);
+        slot->used = true;
+        memo->misses++;
+      }
+    }
+    copy(memo->prevOut, 0, block, 0, BLOCK_SIZE);
+  }
+}
+
+void memoWipe(EcbMemo *memo) { wipe((uint8_t *)memo, sizeof(EcbMemo)); }
+
+bool isZero(uint8_t block[]) {
+  uint64_t words[2];
+  memcpy(words, block, sizeof(words));
+  return (words[0] | words[1]) == 0;
+}
+
+/* Fibonacci hashing, keeps the top bits of the product */
+size_t slotFor(uint8_t block[]) {
+  uint64_t words[2];
+  memcpy(words, block, sizeof(words));
+  uint64_t hash = (words[0] ^ (words[1] * 0x9E3779B97F4A7C15u)) *
+                  0x9E3779B97F4A7C15u;
+  return (size_t)(hash >> (64 - MEMO_SLOT_BITS));
+}
+
+void cipher(EcbMemo *memo, uint8_t block[]) {
+  if (memo->direction == ENCRYPT)
+    encryptBlock(block, memo->schedule);
+  else
+    decryptBlock(block, memo->schedule);
+}
@@ -0,0 +1,79 @@
+/**
+ * @file ecb_memo.h
+ * @brief Function prototypes for the ECB repeated block cache
+ *
+ * In ECB mode identical input blocks always give identical output blocks, so
+ * the cipher can be skipped for a block that was seen recently. Three checks
+ * run in order before falling back to the cipher:
+ * 1. The block is a copy of the previous block (a run)
+ * 2. The block is all zeros
+ * 3. The block is in a direct-mapped cache of MEMO_SLOTS recent blocks
+ *
+ * This pays off on sparse inputs like disk images, which are mostly zero pages
+ * and repeated filler. Since the hits take less time than the cipher, the
+ * timing reveals which blocks repeat, which ECB output already shows anyway.
+ *
+ * @author Ali Zaheer
+ */
+
+#ifndef ECB_MEMO_H
+#define ECB_MEMO_H
+
+/* -- Includes -- */
+#include "AES.h" /* for KeySchedule and Direction */
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MEMO_SLOT_BITS 8 /* log2 of the number of slots */
+#define MEMO_SLOTS (1 << MEMO_SLOT_BITS)
+
+typedef struct {
+  bool used;
+  uint8_t in[AES_BLOCK_LEN];
+  uint8_t out[AES_BLOCK_LEN];
+} MemoSlot;
+
+typedef struct {
+  const KeySchedule *schedule;
+  Direction direction;
+  bool havePrev;
+  uint8_t prevIn[AES_BLOCK_LEN];
+  uint8_t prevOut[AES_BLOCK_LEN];
+  uint8_t zeroOut[AES_BLOCK_LEN]; /* the all-zero block after the cipher */
+  MemoSlot slots[MEMO_SLOTS];
+  /* counters */
+  unsigned long long runHits;
+  unsigned long long zeroHits;
+  unsigned long long slotHits;
+  unsigned long long misses;
+} EcbMemo;
+
+/**
+ * @brief Sets up an empty cache for one key and direction.
+ *
+ * The schedule must stay valid while the cache is used.
+ *
+ * @param memo The cache
+ * @param schedule The expanded key schedule
+ * @param direction Encrypting/decrypting
+ */
+void memoInit(EcbMemo *memo, const KeySchedule *schedule, Direction direction);
+
+/**
+ * @brief Encrypts or decrypts blocks in place, skipping the cipher for blocks
+ * already in the cache.
+ *
+ * @param memo The cache
+ * @param bytes The blocks
+ * @param len Number of bytes, must be a multiple of BLOCK_SIZE
+ */
+void memoBlocks(EcbMemo *memo, uint8_t bytes[], size_t len);
+
+/**
+ * @brief Wipes every cached block.
+ *
+ * @param memo The cache
+ */
+void memoWipe(EcbMemo *memo);
+
+#endif
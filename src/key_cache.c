@@ -0,0 +1,166 @@
+/**
+ * @file key_cache.c
+ * @brief Implements the sharded LRU cache of expanded key schedules
+ *
+ * A key is hashed to pick its shard, and only that shard's lock is taken for a
+ * lookup, so threads working with different keys rarely wait on each other.
+ * Each shard is a small fully associative set of KEY_CACHE_WAYS entries. Every
+ * access stamps the entry with the shard's tick counter, and the entry with the
+ * oldest stamp is the one evicted. The key expansion on a miss runs outside the
+ * lock.
+ *
+ * Every eviction bumps a generation counter. A thread's copy of its last
+ * schedule remembers the generation it was fetched in, and is dropped once the
+ * counter has moved on, so no copy outlives the eviction of its key for longer
+ * than its thread takes to make another call.
+ *
+ * @author Ali Zaheer
+ */
+
+/* -- Includes -- */
+#include "key_cache.h" /* for public function prototypes */
+#include "byte_ops.h"  /* for copy and wipe */
+#include <stdatomic.h> /* for the counters */
+#include <string.h>    /* for memcmp */
+#include <threads.h>   /* for the shard locks */
+
+typedef struct {
+  bool used;
+  uint64_t lastUse; /* shard tick of the latest access */
+  uint8_t key[AES_KEY_LEN];
+  KeySchedule schedule;
+} Entry;
+
+typedef struct {
+  mtx_t lock;
+  uint64_t tick;
+  Entry entries[KEY_CACHE_WAYS];
+} Shard;
+
+static Shard shards[KEY_CACHE_SHARDS];
+static once_flag initFlag = ONCE_FLAG_INIT;
+
+static atomic_ullong hits;
+static atomic_ullong misses;
+static atomic_ullong evictions;
+static atomic_ullong generation; /* bumped by every eviction */
+
+/* The schedule of the key last used by this thread, for keyCacheLast() */
+static _Thread_local struct {
+  bool used;
+  unsigned long long generation;
+  uint8_t key[AES_KEY_LEN];
+  KeySchedule schedule;
+} last;
+
+/* Local functions */
+static void initShards(void);
+static Shard *shardFor(uint8_t key[]);
+static Entry *findEntry(Shard *shard, uint8_t key[]);
+static void evictEntry(Entry *entry);
+
+bool keyCacheGet(uint8_t key[], KeySchedule *schedule) {
+  call_once(&initFlag, initShards);
+  Shard *shard = shardFor(key);
+
+  mtx_lock(&shard->lock);
+  Entry *entry = findEntry(shard, key);
+  if (entry != NULL) {
+    entry->lastUse = ++shard->tick;
+    *schedule = entry->schedule;
+    mtx_unlock(&shard->lock);
+    atomic_fetch_add_explicit(&hits, 1, memory_order_relaxed);
+    return true;
+  }
+  mtx_unlock(&shard->lock);
+
+  atomic_fetch_add_explicit(&misses, 1, memory_order_relaxed);
+  expandKey(key, schedule);
+
+  mtx_lock(&shard->lock);
+  /* another thread may have inserted the same key while this one expanded it */
+  if ((entry = findEntry(shard, key)) == NULL) {
+    /* least recently used entry, where unused entries count as the oldest */
+    entry = &shard->entries[0];
+    for (size_t i = 0; i < KEY_CACHE_WAYS && entry->used; i++) {
+      if (!shard->entries[i].used || shard->entries[i].lastUse < entry->lastUse)
+        entry = &shard->entries[i];
+    }
+    if (entry->used) {
+      evictEntry(entry);
+      atomic_fetch_add_explicit(&evictions, 1, memory_order_relaxed);
+    }
+    entry->used = true;
+    copy(entry->key, 0, key, 0, KEY_SIZE);
+    entry->schedule = *schedule;
+  }
+  entry->lastUse = ++shard->tick;
+  mtx_unlock(&shard->lock);
+  return false;
+}
+
+const KeySchedule *keyCacheLast(uint8_t key[]) {
+  unsigned long long current =
+      atomic_load_explicit(&generation, memory_order_acquire);
+  if (!last.used || last.generation != current ||
+      memcmp(last.key, key, KEY_SIZE) != 0) {
+    keyCacheForgetThread();
+    keyCacheGet(key, &last.schedule);
+    copy(last.key, 0, key, 0, KEY_SIZE);
+    last.generation = current;
+    last.used = true;
+  }
+  return &last.schedule;
+}
+
+void keyCacheForgetThread(void) { wipe((uint8_t *)&last, sizeof(last)); }
+
+void keyCacheStats(KeyCacheStats *stats) {
+  stats->hits = atomic_load_explicit(&hits, memory_order_relaxed);
+  stats->misses = atomic_load_explicit(&misses, memory_order_relaxed);
+  stats->evictions = atomic_load_explicit(&evictions, memory_order_relaxed);
+}
+
+void keyCacheClear(void) {
+  call_once(&initFlag, initShards);
+  for (size_t i = 0; i < KEY_CACHE_SHARDS; i++) {
+    mtx_lock(&shards[i].lock);
+    for (size_t j = 0; j < KEY_CACHE_WAYS; j++) {
+      if (shards[i].entries[j].used)
+        evictEntry(&shards[i].entries[j]);
+    }
+    mtx_unlock(&shards[i].lock);
+  }
+  keyCacheForgetThread();
+}
+
+void initShards(void) {
+  for (size_t i = 0; i < KEY_CACHE_SHARDS; i++) {
+    mtx_init(&shards[i].lock, mtx_plain);
+  }
+}
+
+/* FNV-1a hash of the key bytes */
+Shard *shardFor(uint8_t key[]) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < KEY_SIZE; i++) {
+    hash = (hash ^ key[i]) * 16777619u;
+  }
+  return &shards[hash % KEY_CACHE_SHARDS];
+}
+
+/* The shard's lock must be held */
+Entry *findEntry(Shard *shard, uint8_t key[]) {
+  for (size_t i = 0; i < KEY_CACHE_WAYS; i++) {
+    Entry *entry = &shard->entries[i];
+    if (entry->used && memcmp(entry->key, key, KEY_SIZE) == 0)
+      return entry;
+  }
+  return NULL;
+}
+
+/* The shard's lock must be held */
+void evictEntry(Entry *entry) {
+  wipe((uint8_t *)entry, sizeof(Entry));
+  atomic_fetch_add_explicit(&generation, 1, memory_order_release);
+}
@@ -0,0 +1,91 @@
+/**
+ * @file key_cache.h
+ * @brief Function prototypes for the expanded key schedule cache
+ *
+ * The cache maps a 16 byte key to its expanded key schedule so that the key
+ * expansion only runs the first time a key is seen. It is bounded and safe to
+ * use from multiple threads. Entries are spread over KEY_CACHE_SHARDS shards,
+ * each with its own lock, and every shard evicts its least recently used entry
+ * when full. Evicted schedules are wiped.
+ *
+ * Each thread may also hold a copy of the schedule it used last, for
+ * keyCacheLast(). The copy is wiped and fetched again once any schedule has
+ * been evicted, and can be wiped right away with keyCacheForgetThread().
+ *
+ * @author Ali Zaheer
+ */
+
+#ifndef KEY_CACHE_H
+#define KEY_CACHE_H
+
+/* -- Includes -- */
+#include "AES.h" /* for KeySchedule */
+#include <stdbool.h>
+#include <stdint.h>
+
+#define KEY_CACHE_SHARDS 8 /* number of independently locked shards */
+#define KEY_CACHE_WAYS 8   /* entries per shard */
+
+/**
+ * Running totals since the start of the program. A lookup is either a hit or a
+ * miss, and a miss on a full shard also counts as an eviction.
+ */
+typedef struct {
+  unsigned long long hits;
+  unsigned long long misses;
+  unsigned long long evictions;
+} KeyCacheStats;
+
+/**
+ * @brief Copies the expanded key schedule for a key out of the cache.
+ *
+ * On a miss the key is expanded and inserted, evicting the least recently used
+ * entry of its shard if needed. The copy belongs to the caller, who should wipe
+ * it once done.
+ *
+ * @param key The 16 byte key
+ * @param schedule The schedule to fill in
+ *
+ * @return True if the key was already cached, otherwise false
+ */
+bool keyCacheGet(uint8_t key[], KeySchedule *schedule);
+
+/**
+ * @brief Gives the expanded key schedule for a key without locking when the
+ * calling thread used the same key last.
+ *
+ * The schedule is the calling thread's own copy. It stays valid until the
+ * thread's next call with another key, or until keyCacheForgetThread() or
+ * keyCacheClear() is called on the thread.
+ *
+ * @param key The 16 byte key
+ *
+ * @return The schedule
+ */
+const KeySchedule *keyCacheLast(uint8_t key[]);
+
+/**
+ * @brief Wipes the calling thread's copy of its last schedule.
+ *
+ * Threads that used keyCacheLast() should call this before they exit, since a
+ * thread's copy can't be reached from other threads.
+ */
+void keyCacheForgetThread(void);
+
+/**
+ * @brief Reads the cache's hit, miss and eviction counters.
+ *
+ * @param stats Struct to store the counters in
+ */
+void keyCacheStats(KeyCacheStats *stats);
+
+/**
+ * @brief Wipes and removes every cached schedule.
+ *
+ * The calling thread's copy from keyCacheLast() is wiped as well, and the
+ * copies of other threads are wiped the next time they call keyCacheLast().
+ * The counters are left untouched.
+ */
+void keyCacheClear(void);
+
+#endif
@@ -0,0 +1,152 @@
+/**
+ * @file lz.c
+ * @brief Implements the built-in LZ compressor
+ *
+ * Matches are found with a hash table indexed by the next LZ_MIN_MATCH bytes,
+ * which remembers the latest position each hash was seen at. Only the latest
+ * candidate is checked, which trades some compression ratio for speed.
+ *
+ * @author Ali Zaheer
+ */
+
+/* -- Includes -- */
+#include "lz.h"     /* for public function prototypes */
+#include <string.h> /* for memcpy and memset */
+
+#define HASH_BITS 12
+#define MAX_OFFSET 65535 /* offsets are stored in two bytes */
+
+/* Local functions */
+static uint32_t hash(const uint8_t bytes[]);
+static uint8_t *putLength(uint8_t *op, size_t len);
+static uint8_t *putSequence(uint8_t *op, const uint8_t literals[],
+                            size_t litLen, size_t offset, size_t matchLen);
+static bool getLength(const uint8_t **ip, const uint8_t *end, size_t *len);
+
+/* every 255 input bytes can add at most one extra length byte */
+size_t lzBound(size_t len) { return len + (len / 255) + 16; }
+
+size_t lzCompress(const uint8_t in[], size_t len, uint8_t out[]) {
+  uint32_t table[1 << HASH_BITS]; /* position + 1, 0 for none */
+  memset(table, 0, sizeof(table));
+
+  uint8_t *op = out;
+  size_t anchor = 0; /* start of the pending literals */
+  size_t i = 0;
+  while (i + LZ_MIN_MATCH <= len) {
+    uint32_t h = hash(&in[i]);
+    size_t candidate = table[h];
+    table[h] = (uint32_t)(i + 1);
+
+    if (candidate == 0 || (i - (candidate - 1)) > MAX_OFFSET ||
+        memcmp(&in[candidate - 1], &in[i], LZ_MIN_MATCH) != 0) {
+      i++;
+      continue;
+    }
+    candidate--;
+    size_t matchLen = LZ_MIN_MATCH;
+    while (i + matchLen < len && in[candidate + matchLen] == in[i + matchLen]) {
+      matchLen++;
+    }
+    op = putSequence(op, &in[anchor], i - anchor, i - candidate, matchLen);
+    i += matchLen;
+    anchor = i;
+  }
+
+  /* the final sequence carries the remaining literals and no match */
+  size_t litLen = len - anchor;
+  *op++ = (uint8_t)((litLen < 15 ? litLen : 15) << 4);
+  if (litLen >= 15)
+    op = putLength(op, litLen - 15);
+  memcpy(op, &in[anchor], litLen);
+  op += litLen;
+  return (size_t)(op - out);
+}
+
+/* a match may overlap its own output, so it is copied byte by byte */
+bool lzDecompress(const uint8_t in[], size_t len, uint8_t out[], size_t cap,
+                  size_t *outLen) {
+  const uint8_t *ip = in;
+  const uint8_t *end = in + len;
+  size_t op = 0;
+
+  while (ip < end) {
+    uint8_t token = *ip++;
+
+    size_t litLen = token >> 4;
+    if (litLen == 15 && !getLength(&ip, end, &litLen))
+      return false;
+    if (litLen > (size_t)(end - ip) || litLen > cap - op)
+      return false;
+    memcpy(&out[op], ip, litLen);
+    ip += litLen;
+    op += litLen;
+
+    if (ip == end) /* last sequence */
+      break;
+
+    if (end - ip < 2)
+      return false;
+    size_t offset = ip[0] | ((size_t)ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > op)
+      return false;
+
+    size_t matchLen = token & 0x0F;
+    if (matchLen == 15 && !getLength(&ip, end, &matchLen))
+      return false;
+    matchLen += LZ_MIN_MATCH;
+    if (matchLen > cap - op)
+      return false;
+    for (size_t j = 0; j < matchLen; j++, op++) {
+      out[op] = out[op - offset];
+    }
+  }
+  *outLen = op;
+  return true;
+}
+
+/* Fibonacci hashing of the next four bytes */
+uint32_t hash(const uint8_t bytes[]) {
+  uint32_t word;
+  memcpy(&word, bytes, sizeof(word));
+  return (word * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* extra length bytes: a run of 255s and a final byte under 255 */
+uint8_t *putLength(uint8_t *op, size_t len) {
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (uint8_t)len;
+  return op;
+}
+
+uint8_t *putSequence(uint8_t *op, const uint8_t literals[], size_t litLen,
+                     size_t offset, size_t matchLen) {
+  size_t extraMatch = matchLen - LZ_MIN_MATCH;
+  *op++ = (uint8_t)(((litLen < 15 ? litLen : 15) << 4) |
+                    (extraMatch < 15 ? extraMatch : 15));
+  if (litLen >= 15)
+    op = putLength(op, litLen - 15);
+  memcpy(op, literals, litLen);
+  op += litLen;
+  *op++ = (uint8_t)(offset & 0xFF);
+  *op++ = (uint8_t)(offset >> 8);
+  if (extraMatch >= 15)
+    op = putLength(op, extraMatch - 15);
+  return op;
+}
+
+/* adds the extra length bytes to the nibble value already in len */
+bool getLength(const uint8_t **ip, const uint8_t *end, size_t *len) {
+  uint8_t byte;
+  do {
+    if (*ip >= end)
+      return false;
+    byte = *(*ip)++;
+    *len += byte;
+  } while (byte == 255);
+  return true;
+}
@@ -0,0 +1,68 @@
+/**
+ * @file lz.h
+ * @brief Function prototypes for the built-in LZ compressor
+ *
+ * A small LZ77 compressor in the style of LZ4, used to shrink the plaintext
+ * before it is encrypted, since ciphertext can't be compressed afterwards. It
+ * works on independent chunks of at most LZ_CHUNK bytes, so every chunk can be
+ * decompressed without the others.
+ *
+ * The compressed data is a series of sequences. Each sequence is a token byte
+ * holding the number of literal bytes in its high nibble and the match length
+ * minus LZ_MIN_MATCH in its low nibble, followed by extra length bytes when a
+ * nibble is 15, the literal bytes, a two byte little-endian offset back to the
+ * match, and the extra match length bytes. The last sequence only has
+ * literals.
+ *
+ * @author Ali Zaheer
+ */
+
+#ifndef LZ_H
+#define LZ_H
+
+/* -- Includes -- */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define LZ_CHUNK 65536 /* largest chunk of input compressed at once */
+#define LZ_MIN_MATCH 4 /* shortest match worth encoding */
+
+/**
+ * @brief Gives the largest possible compressed size for an input length.
+ *
+ * @param len Input length
+ *
+ * @return Size of the output buffer needed by lzCompress
+ */
+size_t lzBound(size_t len);
+
+/**
+ * @brief Compresses a chunk of bytes.
+ *
+ * @param in The bytes to compress
+ * @param len Number of bytes, at most LZ_CHUNK
+ * @param out Array of at least lzBound(len) bytes to store the result
+ *
+ * @return Compressed length
+ */
+size_t lzCompress(const uint8_t in[], size_t len, uint8_t out[]);
+
+/**
+ * @brief Decompresses a chunk compressed by lzCompress.
+ *
+ * The input is fully bounds checked, so corrupt data fails instead of reading
+ * or writing out of bounds.
+ *
+ * @param in The compressed bytes
+ * @param len Number of compressed bytes
+ * @param out Array to store the result
+ * @param cap Size of the out array
+ * @param outLen Where to store the decompressed length
+ *
+ * @return True if the data was valid, otherwise false
+ */
+bool lzDecompress(const uint8_t in[], size_t len, uint8_t out[], size_t cap,
+                  size_t *outLen);
+
+#endif
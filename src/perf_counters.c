@@ -0,0 +1,128 @@
+/**
+ * @file perf_counters.c
+ * @brief Implements hardware performance counters using perf_event_open
+ *
+ * Each counter is opened as its own event so that one the CPU doesn't support
+ * doesn't take the others down with it. Kernel and hypervisor activity is
+ * excluded, which also lets unprivileged users count when
+ * perf_event_paranoid is 2.
+ *
+ * @author Ali Zaheer
+ */
+
+/* for syscall */
+#define _GNU_SOURCE
+
+/* -- Includes -- */
+#include "perf_counters.h" /* for public function prototypes */
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Local function */
+static int openCounter(uint32_t type, uint64_t config);
+
+bool perfOpen(PerfCounters *counters) {
+  const uint64_t L1D_READ_MISS = PERF_COUNT_HW_CACHE_L1D |
+                                 (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+  counters->fds[CTR_CYCLES] =
+      openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+  counters->fds[CTR_INSTRUCTIONS] =
+      openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+  counters->fds[CTR_L1D_MISSES] = openCounter(PERF_TYPE_HW_CACHE, L1D_READ_MISS);
+  counters->fds[CTR_BRANCH_MISSES] =
+      openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    if (counters->fds[i] >= 0)
+      return true;
+  }
+  return false;
+}
+
+void perfStart(PerfCounters *counters) {
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    if (counters->fds[i] >= 0) {
+      ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+/**
+ * With multiplexing the counter only ran for part of the time it was enabled,
+ * so the count is scaled by enabled / running.
+ */
+void perfStop(PerfCounters *counters, uint64_t values[]) {
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    if (counters->fds[i] >= 0)
+      ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+  }
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    uint64_t data[3]; /* value, time enabled, time running */
+    values[i] = 0;
+    if (counters->fds[i] < 0 ||
+        read(counters->fds[i], data, sizeof(data)) != sizeof(data) ||
+        data[2] == 0)
+      continue;
+    values[i] = (data[1] == data[2])
+                    ? data[0]
+                    : (uint64_t)((double)data[0] * data[1] / data[2]);
+  }
+}
+
+void perfClose(PerfCounters *counters) {
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    if (counters->fds[i] >= 0)
+      close(counters->fds[i]);
+    counters->fds[i] = -1;
+  }
+}
+
+int openCounter(uint32_t type, uint64_t config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  /* this thread, any CPU, no group */
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+#else
+
+bool perfOpen(PerfCounters *counters) {
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    counters->fds[i] = -1;
+  }
+  return false;
+}
+
+void perfStart(PerfCounters *counters) { (void)counters; }
+
+void perfStop(PerfCounters *counters, uint64_t values[]) {
+  (void)counters;
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    values[i] = 0;
+  }
+}
+
+void perfClose(PerfCounters *counters) { (void)counters; }
+
+#endif
+
+bool perfAvailable(PerfCounters *counters, Counter counter) {
+  return counters->fds[counter] >= 0;
+}
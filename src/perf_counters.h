@@ -0,0 +1,78 @@
+/**
+ * @file perf_counters.h
+ * @brief Function prototypes for reading hardware performance counters
+ *
+ * Wraps the Linux perf_event_open interface to count CPU cycles, retired
+ * instructions, L1 data cache read misses and branch mispredictions for the
+ * calling thread. Counters the kernel or CPU can't provide are marked
+ * unavailable rather than treated as an error. On other platforms every counter
+ * is unavailable.
+ *
+ * @author Ali Zaheer
+ */
+
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+/* -- Includes -- */
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+  CTR_CYCLES,
+  CTR_INSTRUCTIONS,
+  CTR_L1D_MISSES,
+  CTR_BRANCH_MISSES
+} Counter;
+
+#define NUM_COUNTERS 4
+
+typedef struct {
+  int fds[NUM_COUNTERS]; /* -1 when the counter is unavailable */
+} PerfCounters;
+
+/**
+ * @brief Opens every counter that is available for the calling thread.
+ *
+ * @param counters The counters to open
+ *
+ * @return True if at least one counter could be opened, otherwise false
+ */
+bool perfOpen(PerfCounters *counters);
+
+/**
+ * @brief Checks if a counter was opened.
+ *
+ * @param counters The opened counters
+ * @param counter Which counter
+ *
+ * @return True if the counter is available
+ */
+bool perfAvailable(PerfCounters *counters, Counter counter);
+
+/**
+ * @brief Resets all counters to zero and starts counting.
+ *
+ * @param counters The opened counters
+ */
+void perfStart(PerfCounters *counters);
+
+/**
+ * @brief Stops counting and reads the counts.
+ *
+ * When the kernel had to multiplex the counters, the counts are scaled up to
+ * the full measured time. Unavailable counters read as 0.
+ *
+ * @param counters The opened counters
+ * @param values Array of NUM_COUNTERS to store the counts in
+ */
+void perfStop(PerfCounters *counters, uint64_t values[]);
+
+/**
+ * @brief Closes all counters.
+ *
+ * @param counters The opened counters
+ */
+void perfClose(PerfCounters *counters);
+
+#endif
@@ -0,0 +1,144 @@
+/**
+ * @file reader.c
+ * @brief Implements random access reads of encrypted files
+ *
+ * The ciphertext is read a page at a time with positioned reads of a block
+ * stream, so reads don't disturb each other's file position. Pages are cached
+ * in a small fully associative set that evicts the least recently used page, in
+ * the same way as the key cache. The last page of the file may be shorter than
+ * READER_PAGE.
+ *
+ * @author Ali Zaheer
+ */
+
+/* -- Includes -- */
+#include "reader.h"    /* for public function prototypes */
+#include "AES.h"          /* for decryption */
+#include "block_stream.h" /* for positioned reads of the ciphertext */
+#include "byte_ops.h"     /* for copy and wipe */
+#include "key_cache.h"    /* for the expanded key schedule */
+#include "stats.h"        /* for the --stats report */
+
+typedef struct {
+  bool used;
+  uint64_t index; /* page number in the file */
+  uint64_t lastUse;
+  uint8_t bytes[READER_PAGE];
+} Page;
+
+struct Reader {
+  BlockStream *in;
+  uint64_t cipherLen;
+  uint64_t plainLen;
+  uint64_t tick;
+  KeySchedule schedule;
+  Page pages[READER_PAGES];
+};
+
+/* Local functions */
+static Page *getPage(Reader *reader, uint64_t index);
+static bool readFull(BlockStream *in, uint8_t buf[], size_t len,
+                     uint64_t offset);
+
+Reader *readerOpen(char *path, uint8_t key[]) {
+  Reader *reader = (Reader *)calloc(1, sizeof(Reader));
+  if (reader == NULL)
+    return NULL;
+  if ((reader->in = streamOpenRead(path, false)) == NULL) {
+    free(reader);
+    return NULL;
+  }
+  keyCacheGet(key, &reader->schedule);
+
+  struct stat info;
+  uint8_t block[BLOCK_SIZE];
+  uint8_t padBytes = 0;
+  if (streamStat(reader->in, &info) && info.st_size > 0 &&
+      (info.st_size % BLOCK_SIZE) == 0) {
+    reader->cipherLen = (uint64_t)info.st_size;
+    if (readFull(reader->in, block, BLOCK_SIZE, reader->cipherLen - BLOCK_SIZE))
+      padBytes = checkPad(decryptBlock(block, &reader->schedule));
+  }
+  if (padBytes == 0) {
+    readerClose(reader);
+    return NULL;
+  }
+  reader->plainLen = reader->cipherLen - padBytes;
+  wipe(block, BLOCK_SIZE);
+  return reader;
+}
+
+uint64_t readerSize(Reader *reader) { return reader->plainLen; }
+
+int64_t readerPread(Reader *reader, uint8_t buf[], size_t len,
+                    uint64_t offset) {
+  if (offset >= reader->plainLen)
+    return 0;
+  if (len > reader->plainLen - offset)
+    len = (size_t)(reader->plainLen - offset);
+
+  size_t done = 0;
+  while (done < len) {
+    uint64_t position = offset + done;
+    Page *page = getPage(reader, position / READER_PAGE);
+    if (page == NULL)
+      return -1;
+    size_t start = (size_t)(position % READER_PAGE);
+    size_t bytes = READER_PAGE - start;
+    if (bytes > len - done)
+      bytes = len - done;
+    copy(buf, done, page->bytes, start, bytes);
+    done += bytes;
+  }
+  return (int64_t)done;
+}
+
+void readerClose(Reader *reader) {
+  streamClose(reader->in);
+  wipe((uint8_t *)reader, sizeof(Reader));
+  free(reader);
+}
+
+/* Returns the page from the cache, or reads and decrypts it on a miss */
+Page *getPage(Reader *reader, uint64_t index) {
+  Page *page = &reader->pages[0];
+  for (size_t i = 0; i < READER_PAGES; i++) {
+    Page *candidate = &reader->pages[i];
+    if (candidate->used && candidate->index == index) {
+      candidate->lastUse = ++reader->tick;
+      return candidate;
+    }
+    /* least recently used, where unused pages count as the oldest */
+    if (page->used && (!candidate->used || candidate->lastUse < page->lastUse))
+      page = candidate;
+  }
+
+  uint64_t offset = index * READER_PAGE;
+  size_t len = READER_PAGE;
+  if (len > reader->cipherLen - offset)
+    len = (size_t)(reader->cipherLen - offset);
+  uint64_t start = statsStart();
+  bool ok = readFull(reader->in, page->bytes, len, offset);
+  statsStop(STAGE_READ, start);
+  if (!ok) {
+    page->used = false;
+    return NULL;
+  }
+  statsBytesIn(len);
+
+  start = statsStart();
+  for (size_t i = 0; i < len; i += BLOCK_SIZE) {
+    decryptBlock(&page->bytes[i], &reader->schedule);
+  }
+  statsStop(STAGE_CIPHER, start);
+  statsBlocks(len / BLOCK_SIZE);
+  page->used = true;
+  page->index = index;
+  page->lastUse = ++reader->tick;
+  return page;
+}
+
+/* a read that ends early means the file shrank, which counts as an error */
+bool readFull(BlockStream *in, uint8_t buf[], size_t len, uint64_t offset) {
+  return streamPread(in, buf, len, offset) == (int64_t)len;
+}
@@ -0,0 +1,73 @@
+/**
+ * @file reader.h
+ * @brief Function prototypes for random access reads of encrypted files
+ *
+ * Every block of an ECB file can be decrypted on its own, so a byte range of
+ * the plaintext can be read without decrypting the rest of the file. A reader
+ * decrypts only the blocks that cover the requested range, and keeps the most
+ * recently used pages of READER_PAGE bytes decrypted in memory so that hot
+ * ranges are not decrypted again.
+ *
+ * A reader is not safe to share between threads. Open one per thread instead.
+ *
+ * @author Ali Zaheer
+ */
+
+#ifndef READER_H
+#define READER_H
+
+/* -- Includes -- */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define READER_PAGE 4096 /* bytes per cached page, a multiple of BLOCK_SIZE */
+#define READER_PAGES 16  /* number of cached pages */
+
+typedef struct Reader Reader;
+
+/**
+ * @brief Opens a file encrypted by this program for random access reads.
+ *
+ * The final block is decrypted right away to find the length of the padding,
+ * so a wrong key or a file that isn't a whole number of blocks is caught here.
+ *
+ * @param path Path of the encrypted file
+ * @param key The key used during encryption
+ *
+ * @return The reader, or NULL if the file couldn't be opened or isn't valid
+ */
+Reader *readerOpen(char *path, uint8_t key[]);
+
+/**
+ * @brief Gives the length of the plaintext, without its padding.
+ *
+ * @param reader The reader
+ *
+ * @return Plaintext length in bytes
+ */
+uint64_t readerSize(Reader *reader);
+
+/**
+ * @brief Reads a range of the plaintext.
+ *
+ * Reads that go past the end of the plaintext are cut short.
+ *
+ * @param reader The reader
+ * @param buf Array to store the plaintext in
+ * @param len Number of bytes to read
+ * @param offset Position in the plaintext to start from
+ *
+ * @return Number of bytes read, or -1 if there was a read error
+ */
+int64_t readerPread(Reader *reader, uint8_t buf[], size_t len,
+                    uint64_t offset);
+
+/**
+ * @brief Closes the file and wipes the cached plaintext.
+ *
+ * @param reader The reader
+ */
+void readerClose(Reader *reader);
+
+#endif
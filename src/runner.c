@@ -10,46 +10,104 @@
  */
 
 /* -- Includes -- */
-#include "AES.h"      /* for encryption/decryption */
-#include "byte_ops.h" /* for byte array operations */
-#include <stdbool.h>  /* for bool */
-#include <stdint.h>   /* for uint8_t */
+#include "AES.h"          /* for encryption/decryption */
+#include "block_stream.h" /* for reading and writing blocks */
+#include "byte_ops.h"     /* for byte array operations */
+#include "checksum.h"     /* for the -c checksums */
+#include "ecb_memo.h"     /* for the -m repeated block cache */
+#include "key_cache.h"    /* for the expanded key schedule */
+#include "lz.h"           /* for the -z compression stage */
+#include "reader.h"       /* for the -r range decryption */
+#include "stats.h"        /* for the --stats report */
+#include "tuning.h"       /* for the chunk size and input backend */
+#include "update.h"       /* for the -u update mode */
+#include <errno.h>        /* for out of range counts */
+#include <stdbool.h>      /* for bool */
+#include <stdint.h>       /* for uint8_t */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #define ERROR_USE                                                              \
-  "Usage: AES [-mode] [-option] [input file] [output file]\n\
-    modes: [-e] encryption, [-d] decryption\n\
+  "Usage: AES [-mode] [-option] [input file] [output file] [-m] [-z] [-c]\n\
+           [-r offset length] [--direct] [--calibrate | --tune=chunk,mmap|read]\n\
+           [--stats[=json]]\n\
+    modes: [-e] encryption, [-d] decryption, [-u] update an encrypted file\n\
     options: [] stdin/stdout, [-f] separate in/out files\n\
+    -m skips the cipher for repeated blocks in the file modes other than -r\n\
+    -z compresses files before encrypting them, and decompresses after decrypting\n\
+    -c checksums the plaintext and ciphertext of files while they are processed\n\
+    -r decrypts only the given byte range of the plaintext of a file\n\
+    --direct reads and writes files with direct I/O, bypassing the page cache\n\
+    --calibrate measures the fastest chunk size and input backend for this CPU\n\
+      and keeps them for later runs, which takes a few seconds\n\
+    --tune uses the given chunk size and input backend instead of the measured ones\n\
+    --stats prints the time spent in each stage of the file modes to stderr\n\
     Filenames must follow the file option in the order of input and then output.\n\
+    The update mode takes the new plaintext as the input file and the ciphertext\n\
+    to update as the output file, and only rewrites the parts that changed.\n\
 ***Warning*** For the separate files option, the ouput file will be overwritten if it already exists.\n"
 
 #define BUF_LEN 1024 /* Size of buffer */
+#define FRAME_HEADER 8 /* two 4 byte lengths ahead of each compressed chunk */
 
 /* Local functions */
-static int nextBlock(FILE *fp, uint8_t dest[], size_t len);
-static bool fileEncrypt(FILE *in, FILE *out, uint8_t key[]);
-static bool fileDecrypt(FILE *in, FILE *out, size_t fileLen, uint8_t key[]);
+static bool encryptStream(BlockStream *in, BlockStream *out, uint8_t key[],
+                          bool memoize, size_t chunk, Digests *digests);
+static bool decryptStream(BlockStream *in, BlockStream *out, uint8_t key[],
+                          bool memoize, size_t chunk, Digests *digests);
+static bool compressEncryptStream(BlockStream *in, BlockStream *out,
+                                  uint8_t key[], bool memoize,
+                                  Digests *digests);
+static bool decryptDecompressStream(BlockStream *in, BlockStream *out,
+                                    uint8_t key[], bool memoize,
+                                    Digests *digests);
+static bool rangeDecrypt(char *inFile, BlockStream *out, uint64_t offset,
+                         uint64_t len, uint8_t key[]);
+static void cipherBlocks(uint8_t bytes[], size_t len,
+                         const KeySchedule *schedule, EcbMemo *memo,
+                         Direction direction);
+static void addDigest(uint32_t *crc, uint64_t *total, uint8_t bytes[],
+                      size_t len);
+static bool checkDigests(const Digests *expected, const Digests *actual);
+static int64_t readBytes(BlockStream *in, uint8_t bytes[], size_t len);
+static bool writeBytes(BlockStream *out, uint8_t bytes[], size_t len);
+static void storeLength(uint8_t bytes[], size_t len);
+static size_t loadLength(uint8_t bytes[]);
 
 static size_t readConsole(uint8_t **textBytes, Direction direction);
-static void consoleEncrypt(uint8_t bytes[], size_t len, uint8_t key[]);
+static bool consoleEncrypt(uint8_t bytes[], size_t len, uint8_t key[]);
 static bool consoleDecrypt(uint8_t bytes[], size_t len, uint8_t key[]);
 
 static bool readKey(uint8_t key[], size_t len);
 static void errorExit(char *msg, int numFiles, FILE *fpv[]);
+static void fileError(char *msg, char *path);
+static bool parseCount(char *text, uint64_t *value);
 
 int main(int argc, char *argv[]) {
-  if (argc > 5) {
+  if (argc > 14) {
     errorExit(ERROR_USE, 0, NULL);
   }
 
-  Direction direction;
+  Direction direction = ENCRYPT;
   bool notSet = true; /* input mode not choosen yet */
-  FILE *in;
-  FILE *out;
+  bool update = false;
+  BlockStream *in;
+  BlockStream *out;
   char *inFile = NULL;
-  char *outFile;
+  char *outFile = NULL;
+  bool memoize = false;
+  bool compress = false;
+  bool checksum = false;
+  bool range = false;
+  uint64_t rangeOffset = 0;
+  uint64_t rangeLen = 0;
+  bool direct = false;
+  bool calibrate = false;
+  bool tuned = false; /* configuration given on the command line */
+  Tuning tuning;
+  bool stats = false;
+  bool statsJson = false;
   /* Validating command line options and file names */
   for (int i = 1; i < argc; i++) {
     if (notSet && (strcmp(argv[i], "-e") == 0)) {
@@ -58,14 +116,51 @@ int main(int argc, char *argv[]) {
     } else if (notSet && (strcmp(argv[i], "-d") == 0)) {
       direction = DECRYPT;
       notSet = false;
+    } else if (notSet && (strcmp(argv[i], "-u") == 0)) {
+      direction = ENCRYPT;
+      update = true;
+      notSet = false;
     } else if ((i < argc - 2) && (strcmp(argv[i], "-f") == 0)) {
       inFile = argv[++i];
       outFile = argv[++i];
+    } else if (!memoize && (strcmp(argv[i], "-m") == 0)) {
+      memoize = true;
+    } else if (!compress && (strcmp(argv[i], "-z") == 0)) {
+      compress = true;
+    } else if (!checksum && (strcmp(argv[i], "-c") == 0)) {
+      checksum = true;
+    } else if (!range && (i < argc - 2) && (strcmp(argv[i], "-r") == 0)) {
+      range = true;
+      if (!parseCount(argv[++i], &rangeOffset) ||
+          !parseCount(argv[++i], &rangeLen)) {
+        errorExit(ERROR_USE, 0, NULL);
+      }
+    } else if (!direct && (strcmp(argv[i], "--direct") == 0)) {
+      direct = true;
+    } else if (!calibrate && !tuned && (strcmp(argv[i], "--calibrate") == 0)) {
+      calibrate = true;
+    } else if (!calibrate && !tuned && (strncmp(argv[i], "--tune=", 7) == 0)) {
+      tuned = true;
+      if (!tuningParse(&argv[i][7], &tuning)) {
+        errorExit(ERROR_USE, 0, NULL);
+      }
+    } else if (!stats && (strcmp(argv[i], "--stats") == 0 ||
+                          strcmp(argv[i], "--stats=json") == 0)) {
+      stats = true;
+      statsJson = (argv[i][7] == '=');
     } else {
       errorExit(ERROR_USE, 0, NULL);
     }
   }
-  if (notSet) {
+  /**
+   * Updates work on whole positions of plain ECB files only, and the console
+   * mode takes none of the options of the file modes.
+   */
+  if (notSet || (update && compress) ||
+      (range && (direction != DECRYPT || compress || memoize)) ||
+      ((direct || checksum || calibrate || tuned) && (update || range)) ||
+      (inFile == NULL && (update || range || memoize || compress || checksum ||
+                          direct || calibrate || tuned || stats))) {
     errorExit(ERROR_USE, 0, NULL);
   }
 
@@ -80,106 +175,493 @@ int main(int argc, char *argv[]) {
     size_t lenBytes = readConsole(&textBytes, direction);
     if (lenBytes == 0) {
       errorExit("Error converting text to bytes", 0, NULL);
-    } else if (direction == ENCRYPT) {
-      consoleEncrypt(textBytes, lenBytes, keyBytes);
-    } else if (!consoleDecrypt(textBytes, lenBytes, keyBytes)) {
+    } else if (direction == ENCRYPT &&
+               !consoleEncrypt(textBytes, lenBytes, keyBytes)) {
+      errorExit("Could not encrypt", 0, NULL);
+    } else if (direction == DECRYPT &&
+               !consoleDecrypt(textBytes, lenBytes, keyBytes)) {
       errorExit("Invalid ciphertext. Could not decrypt", 0, NULL);
     }
     free(textBytes);
+  } else if (range) {
+    if (stats)
+      statsEnable();
+    if ((out = streamOpenWrite(outFile)) == NULL) {
+      fileError("Error opening output file", outFile);
+    }
+    bool ok = rangeDecrypt(inFile, out, rangeOffset, rangeLen, keyBytes);
+    bool writeFailed = streamFailed(out);
+    if (!streamClose(out) || writeFailed) {
+      fileError("Error writing output file", outFile);
+    } else if (!ok) {
+      fileError("Error reading input file", inFile);
+    }
+    if (stats)
+      statsReport(stderr, statsJson);
+  } else if (update) {
+    if (stats)
+      statsEnable();
+    uint64_t rewritten, total;
+    if (!fileUpdate(inFile, outFile, keyBytes, memoize, &rewritten, &total)) {
+      fileError("Error updating output file", outFile);
+    }
+    printf("Rewrote %llu of %llu chunks\n", (unsigned long long)rewritten,
+           (unsigned long long)total);
+    if (stats)
+      statsReport(stderr, statsJson);
   } else {
-    if ((in = fopen(inFile, "rb")) == NULL) {
-      errorExit(strcat("Error opening input file: ", inFile), 0, NULL);
+    /* only --calibrate measures, and its result is kept for later runs */
+    if (calibrate) {
+      if (tuningCalibrate(&tuning))
+        tuningSave(&tuning);
+    } else if (!tuned && !tuningLoad(&tuning)) {
+      tuningDefaults(&tuning);
     }
 
-    if ((out = fopen(outFile, "wb")) == NULL) {
-      errorExit(strcat("Error opening output file: ", outFile), 1,
-                (FILE *[]){in});
+    /**
+     * The output of direct I/O is preallocated to the size it will have. The
+     * size of compressed output isn't known ahead of time, and plaintext is at
+     * most as long as its ciphertext.
+     */
+
+    uint64_t inSize = 0;
+    uint64_t outSize = 0;
+    if (direct) {
+      in = streamOpenDirectRead(inFile, &inSize);
+      if (!compress)
+        outSize = (direction == ENCRYPT)
+                      ? ((inSize / BLOCK_SIZE) + 1) * BLOCK_SIZE
+                      : inSize;
+    } else {
+      in = streamOpenRead(inFile, tuning.map);
+    }
+    if (in == NULL) {
+      fileError("Error opening input file", inFile);
+    }
+    out = direct ? streamOpenDirectWrite(outFile, outSize)
+                 : streamOpenWrite(outFile);
+    if (out == NULL) {
+      streamClose(in);
+      fileError("Error opening output file", outFile);
     }
 
-    fseek(in, 0L, SEEK_END);
-    size_t fileLen = ftell(in);
-    rewind(in);
+    /* decryption checks against the checksums stored with its input */
+    Digests expected;
+    Digests digests = {0, 0, 0, 0};
+    Digests *sums = checksum ? &digests : NULL;
+    if (checksum && direction == DECRYPT && !digestsLoad(inFile, &expected)) {
+      streamClose(in);
+      streamClose(out);
+      fileError("Error reading checksum file of input file", inFile);
+    }
 
-    if (direction == ENCRYPT && !fileEncrypt(in, out, keyBytes)) {
-      errorExit("Error reading input file", 2, (FILE *[]){in, out});
-    } else if (direction == DECRYPT &&
-               !fileDecrypt(in, out, fileLen, keyBytes)) {
-      errorExit("Error reading input file", 2, (FILE *[]){in, out});
+    if (stats)
+      statsEnable();
+
+    bool ok;
+    if (compress) {
+      ok = (direction == ENCRYPT)
+               ? compressEncryptStream(in, out, keyBytes, memoize, sums)
+               : decryptDecompressStream(in, out, keyBytes, memoize, sums);
+    } else {
+      ok = (direction == ENCRYPT)
+               ? encryptStream(in, out, keyBytes, memoize, tuning.chunk, sums)
+               : decryptStream(in, out, keyBytes, memoize, tuning.chunk, sums);
     }
-    fclose(in);
-    fclose(out);
+    /* without an I/O error on either side, the input itself was invalid */
+    bool readFailed = streamFailed(in);
+    bool writeFailed = streamFailed(out);
+    streamClose(in);
+    writeFailed = !streamClose(out) || writeFailed;
+    if (readFailed) {
+      fileError("Error reading input file", inFile);
+    } else if (writeFailed) {
+      fileError("Error writing output file", outFile);
+    } else if (!ok && direction == DECRYPT) {
+      fileError("Invalid ciphertext. Could not decrypt input file", inFile);
+    } else if (!ok) {
+      fileError("Could not encrypt input file", inFile);
+    }
+
+    if (checksum) {
+      printf("Plaintext CRC32C: %08lx\nCiphertext CRC32C: %08lx\n",
+             (unsigned long)digests.plain, (unsigned long)digests.cipher);
+      if (direction == ENCRYPT && !digestsSave(outFile, &digests)) {
+        fileError("Error writing checksum file of output file", outFile);
+      } else if (direction == DECRYPT && !checkDigests(&expected, &digests)) {
+        /* the plaintext can't be trusted, so it isn't left behind */
+        remove(outFile);
+        fileError("Checksum mismatch, the input is damaged or the key is wrong",
+                  inFile);
+      }
+    }
+    if (stats)
+      statsReport(stderr, statsJson);
   }
 
   exit(EXIT_SUCCESS);
 }
 
 /**
- * Reads bytes from a file using a buffer. The buffer position indicates the
- * next byte to be read. A position equal to the size indicates that all data
- * has been read. Three cases when new data is read:
- * 1. Full buffer
- * 2. Partial buffer due to EOF
- * 3. Partial buffer due to error
+ * The input is read chunk bytes at a time, a multiple of BLOCK_SIZE. Since
+ * only the end of the stream gives a short read, the first short chunk is the
+ * last one, and its leftover bytes are padded into a final block using PKCS7.
+ * With memoize set, blocks go through the repeated block cache.
+ */
+bool encryptStream(BlockStream *in, BlockStream *out, uint8_t key[],
+                   bool memoize, size_t chunk, Digests *digests) {
+  KeySchedule schedule;
+  keyCacheGet(key, &schedule);
+  EcbMemo memo;
+  if (memoize)
+    memoInit(&memo, &schedule, ENCRYPT);
+
+  uint8_t *buf = streamBuffer(chunk + BLOCK_SIZE);
+  bool ok = (buf != NULL);
+  int64_t bytes = (int64_t)chunk;
+  while (ok && bytes == (int64_t)chunk) {
+    if ((bytes = readBytes(in, buf, chunk)) < 0) {
+      ok = false;
+      break;
+    }
+    size_t len = (size_t)bytes;
+    if (digests != NULL)
+      addDigest(&digests->plain, &digests->plainLen, buf, len);
+    if (bytes < (int64_t)chunk) {
+      size_t tail = len % BLOCK_SIZE;
+      pad(&buf[len - tail], tail);
+      len += BLOCK_SIZE - tail;
+    }
+    cipherBlocks(buf, len, &schedule, memoize ? &memo : NULL, ENCRYPT);
+    if (digests != NULL)
+      addDigest(&digests->cipher, &digests->cipherLen, buf, len);
+    ok = writeBytes(out, buf, len);
+  }
+
+  if (buf != NULL) {
+    wipe(buf, chunk + BLOCK_SIZE);
+    free(buf);
+  }
+  if (memoize) {
+    statsMemo(&memo);
+    memoWipe(&memo);
+  }
+  wipe((uint8_t *)&schedule, sizeof(schedule));
+  return ok;
+}
+
+/**
+ * Each decrypted chunk is held back until the next read shows whether it was
+ * the last chunk of the stream, whose last block holds the padding. Two chunk
+ * buffers take turns, so every chunk is written whole from the aligned buffer
+ * it was read into. If the padding is invalid, this still decrypts but the
+ * result is gibberish. The ciphertext must be a non-empty run of whole blocks.
+ */
+bool decryptStream(BlockStream *in, BlockStream *out, uint8_t key[],
+                   bool memoize, size_t chunk, Digests *digests) {
+  KeySchedule schedule;
+  keyCacheGet(key, &schedule);
+  EcbMemo memo;
+  if (memoize)
+    memoInit(&memo, &schedule, DECRYPT);
+
+  uint8_t *bufs[2] = {streamBuffer(chunk), streamBuffer(chunk)};
+  uint8_t *held = NULL; /* decrypted chunk not written yet */
+  size_t heldLen = 0;
+  bool ok = (bufs[0] != NULL) && (bufs[1] != NULL);
+  int64_t bytes = (int64_t)chunk;
+  for (int turn = 0; ok && bytes == (int64_t)chunk; turn ^= 1) {
+    uint8_t *buf = bufs[turn];
+    bytes = readBytes(in, buf, chunk);
+    if (bytes < 0 || (bytes % BLOCK_SIZE) != 0) {
+      ok = false;
+      break;
+    }
+    if (bytes == 0)
+      break;
+    if (digests != NULL)
+      addDigest(&digests->cipher, &digests->cipherLen, buf, (size_t)bytes);
+    cipherBlocks(buf, (size_t)bytes, &schedule, memoize ? &memo : NULL,
+                 DECRYPT);
+    if (held != NULL) {
+      ok = writeBytes(out, held, heldLen);
+      if (digests != NULL)
+        addDigest(&digests->plain, &digests->plainLen, held, heldLen);
+    }
+    held = buf;
+    heldLen = (size_t)bytes;
+  }
+
+  /* remove the padding from the last block */
+  ok = ok && (held != NULL);
+  if (ok) {
+    heldLen -= checkPad(&held[heldLen - BLOCK_SIZE]);
+    ok = writeBytes(out, held, heldLen);
+    if (digests != NULL)
+      addDigest(&digests->plain, &digests->plainLen, held, heldLen);
+  }
+
+  for (int i = 0; i < 2; i++) {
+    if (bufs[i] != NULL) {
+      wipe(bufs[i], chunk);
+      free(bufs[i]);
+    }
+  }
+  if (memoize) {
+    statsMemo(&memo);
+    memoWipe(&memo);
+  }
+  wipe((uint8_t *)&schedule, sizeof(schedule));
+  return ok;
+}
+
+/**
+ * The input is compressed in chunks of LZ_CHUNK bytes, and each chunk is
+ * written as a frame:
+ * 1. Compressed length, 4 bytes little-endian
+ * 2. Original length, 4 bytes little-endian
+ * 3. The compressed bytes
+ * 4. Zeros up to the next multiple of BLOCK_SIZE
  *
- * First two cases are handled similarly. Last case returns -1 as an error flag.
+ * A chunk that doesn't shrink is stored as is, which is marked by the two
+ * lengths being equal. Since every frame covers whole blocks, frames can be
+ * decrypted and decompressed independently of each other, and no PKCS7 padding
+ * is needed at the end.
  */
-int nextBlock(FILE *fp, uint8_t dest[], size_t len) {
-  static uint8_t buf[BUF_LEN];
-  static size_t bufs = 0; /* buffer size */
-  static size_t bufp = 0; /* buffer position */
-
-  /* read new data to buffer when no more unused data in the buffer*/
-  if (bufp >= bufs) {
-    bufs = fread(buf, sizeof(uint8_t), BUF_LEN, fp);
-    bufp = 0;
-    if (ferror(fp))
-      return -1;
-  }
-  /* minimum of unused bytes available vs bytes requested  */
-  size_t bytes = ((bufs - bufp) < len) ? (bufs - bufp) : len;
-
-  copy(dest, 0, buf, bufp, bytes);
-  bufp += bytes;
-  return bytes;
+bool compressEncryptStream(BlockStream *in, BlockStream *out, uint8_t key[],
+                           bool memoize, Digests *digests) {
+  KeySchedule schedule;
+  keyCacheGet(key, &schedule);
+  EcbMemo memo;
+  if (memoize)
+    memoInit(&memo, &schedule, ENCRYPT);
+
+  uint8_t *raw = streamBuffer(LZ_CHUNK);
+  uint8_t *frame =
+      (uint8_t *)malloc(FRAME_HEADER + lzBound(LZ_CHUNK) + BLOCK_SIZE);
+  bool ok = (raw != NULL) && (frame != NULL);
+  int64_t bytes = LZ_CHUNK;
+  uint64_t start;
+  while (ok && bytes == LZ_CHUNK) {
+    if ((bytes = readBytes(in, raw, LZ_CHUNK)) <= 0) {
+      ok = (bytes == 0);
+      break;
+    }
+    size_t rawLen = (size_t)bytes;
+    if (digests != NULL)
+      addDigest(&digests->plain, &digests->plainLen, raw, rawLen);
+
+    start = statsStart();
+    size_t packedLen = lzCompress(raw, rawLen, &frame[FRAME_HEADER]);
+    if (packedLen >= rawLen) {
+      packedLen = rawLen;
+      copy(frame, FRAME_HEADER, raw, 0, rawLen);
+    }
+    statsStop(STAGE_COMPRESS, start);
+    storeLength(frame, packedLen);
+    storeLength(&frame[FRAME_HEADER / 2], rawLen);
+
+    size_t frameLen = FRAME_HEADER + packedLen;
+    size_t padded = (frameLen + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    for (size_t i = frameLen; i < padded; i++) {
+      frame[i] = 0;
+    }
+    cipherBlocks(frame, padded, &schedule, memoize ? &memo : NULL, ENCRYPT);
+    if (digests != NULL)
+      addDigest(&digests->cipher, &digests->cipherLen, frame, padded);
+    ok = writeBytes(out, frame, padded);
+  }
+
+  if (raw != NULL) {
+    wipe(raw, LZ_CHUNK);
+    free(raw);
+  }
+  if (frame != NULL) {
+    wipe(frame, FRAME_HEADER + lzBound(LZ_CHUNK) + BLOCK_SIZE);
+    free(frame);
+  }
+  if (memoize) {
+    statsMemo(&memo);
+    memoWipe(&memo);
+  }
+  wipe((uint8_t *)&schedule, sizeof(schedule));
+  return ok;
 }
 
-bool fileEncrypt(FILE *in, FILE *out, uint8_t key[]) {
-  uint8_t block[BLOCK_SIZE];
-  int bytes = nextBlock(in, block, BLOCK_SIZE);
-  while ((bytes >= 0) && ((size_t)bytes == BLOCK_SIZE)) {
-    encrypt(block, key);
-    fwrite(block, sizeof(uint8_t), BLOCK_SIZE, out);
-    bytes = nextBlock(in, block, BLOCK_SIZE);
-  }
-  /* encrypt last block, pad as necessary using PKCS7 */
-  if (bytes >= 0) {
-    pad(block, bytes);
-    encrypt(block, key);
-    fwrite(block, sizeof(uint8_t), BLOCK_SIZE, out);
-    return true;
-  }
-  /* there was a read error before EOF */
-  return false;
+/**
+ * Reverses compressEncryptStream() one frame at a time. The first block of a
+ * frame holds its lengths, which tell how many more blocks to read. Frames
+ * with impossible lengths or data that doesn't decompress are rejected.
+ */
+bool decryptDecompressStream(BlockStream *in, BlockStream *out, uint8_t key[],
+                             bool memoize, Digests *digests) {
+  KeySchedule schedule;
+  keyCacheGet(key, &schedule);
+  EcbMemo memo;
+  if (memoize)
+    memoInit(&memo, &schedule, DECRYPT);
+
+  uint8_t *raw = streamBuffer(LZ_CHUNK);
+  uint8_t *frame =
+      (uint8_t *)malloc(FRAME_HEADER + lzBound(LZ_CHUNK) + BLOCK_SIZE);
+  bool ok = (raw != NULL) && (frame != NULL);
+  int64_t bytes;
+  uint64_t start;
+  while (ok) {
+    bytes = readBytes(in, frame, BLOCK_SIZE);
+    if (bytes != (int64_t)BLOCK_SIZE) {
+      ok = (bytes == 0); /* the file must end on a frame boundary */
+      break;
+    }
+    if (digests != NULL)
+      addDigest(&digests->cipher, &digests->cipherLen, frame, BLOCK_SIZE);
+    cipherBlocks(frame, BLOCK_SIZE, &schedule, memoize ? &memo : NULL,
+                 DECRYPT);
+
+    size_t packedLen = loadLength(frame);
+    size_t rawLen = loadLength(&frame[FRAME_HEADER / 2]);
+    if (rawLen == 0 || rawLen > LZ_CHUNK || packedLen > lzBound(rawLen)) {
+      ok = false;
+      break;
+    }
+    size_t frameLen = FRAME_HEADER + packedLen;
+    size_t padded = (frameLen + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+
+    bytes = readBytes(in, &frame[BLOCK_SIZE], padded - BLOCK_SIZE);
+    if (bytes != (int64_t)(padded - BLOCK_SIZE)) {
+      ok = false;
+      break;
+    }
+    if (digests != NULL)
+      addDigest(&digests->cipher, &digests->cipherLen, &frame[BLOCK_SIZE],
+                padded - BLOCK_SIZE);
+    cipherBlocks(&frame[BLOCK_SIZE], padded - BLOCK_SIZE, &schedule,
+                 memoize ? &memo : NULL, DECRYPT);
+
+    start = statsStart();
+    size_t unpackedLen = packedLen;
+    uint8_t *result = &frame[FRAME_HEADER];
+    if (packedLen != rawLen) {
+      ok = lzDecompress(&frame[FRAME_HEADER], packedLen, raw, LZ_CHUNK,
+                        &unpackedLen);
+      result = raw;
+    }
+    statsStop(STAGE_COMPRESS, start);
+    if (!ok || unpackedLen != rawLen) {
+      ok = false;
+      break;
+    }
+    ok = writeBytes(out, result, rawLen);
+    if (digests != NULL)
+      addDigest(&digests->plain, &digests->plainLen, result, rawLen);
+  }
+
+  if (raw != NULL) {
+    wipe(raw, LZ_CHUNK);
+    free(raw);
+  }
+  if (frame != NULL) {
+    wipe(frame, FRAME_HEADER + lzBound(LZ_CHUNK) + BLOCK_SIZE);
+    free(frame);
+  }
+  if (memoize) {
+    statsMemo(&memo);
+    memoWipe(&memo);
+  }
+  wipe((uint8_t *)&schedule, sizeof(schedule));
+  return ok;
 }
 
-bool fileDecrypt(FILE *in, FILE *out, size_t fileLen, uint8_t key[]) {
-  uint8_t block[BLOCK_SIZE];
-  int bytes = nextBlock(in, block, BLOCK_SIZE);
-  for (unsigned i = 1; (bytes > 0) && ((size_t)bytes == BLOCK_SIZE); i++) {
-    decrypt(block, key);
-    if (i >= (fileLen / BLOCK_SIZE)) {
-      /**
-       *  On the last block, remove padding. If the padding is invalid,
-       *  this still decrypts but the result is gibberish.
-       */
-      fwrite(block, sizeof(uint8_t), (BLOCK_SIZE - checkPad(block)), out);
-      return true;
+/**
+ * Only the blocks covering the range are read and decrypted. A range that goes
+ * past the end of the plaintext is cut short.
+ */
+bool rangeDecrypt(char *inFile, BlockStream *out, uint64_t offset,
+                  uint64_t len, uint8_t key[]) {
+  Reader *reader = readerOpen(inFile, key);
+  if (reader == NULL)
+    return false;
+
+  uint8_t buf[READER_PAGE];
+  int64_t bytes = 1;
+  bool ok = true;
+  while (ok && len > 0 && bytes > 0) {
+    bytes = readerPread(reader, buf, (len < READER_PAGE) ? len : READER_PAGE,
+                        offset);
+    if (bytes > 0) {
+      ok = writeBytes(out, buf, (size_t)bytes);
+      offset += (uint64_t)bytes;
+      len -= (uint64_t)bytes;
     }
-    fwrite(block, sizeof(uint8_t), BLOCK_SIZE, out);
-    bytes = nextBlock(in, block, BLOCK_SIZE);
   }
-  /* there was a read error before EOF */
-  return false;
+  readerClose(reader);
+  wipe(buf, READER_PAGE);
+  return ok && bytes >= 0;
+}
+
+/* memo is NULL when the repeated block cache is off */
+void cipherBlocks(uint8_t bytes[], size_t len, const KeySchedule *schedule,
+                  EcbMemo *memo, Direction direction) {
+  uint64_t start = statsStart();
+  if (memo != NULL) {
+    memoBlocks(memo, bytes, len);
+  } else {
+    for (size_t i = 0; i < len; i += BLOCK_SIZE) {
+      if (direction == ENCRYPT)
+        encryptBlock(&bytes[i], schedule);
+      else
+        decryptBlock(&bytes[i], schedule);
+    }
+  }
+  statsStop(STAGE_CIPHER, start);
+  statsBlocks(len / BLOCK_SIZE);
+}
+
+/* digests are NULL when checksums are off, so callers check before calling */
+void addDigest(uint32_t *crc, uint64_t *total, uint8_t bytes[], size_t len) {
+  uint64_t start = statsStart();
+  *crc = crc32c(*crc, bytes, len);
+  *total += len;
+  statsStop(STAGE_CHECKSUM, start);
+}
+
+bool checkDigests(const Digests *expected, const Digests *actual) {
+  return expected->plain == actual->plain &&
+         expected->cipher == actual->cipher &&
+         expected->plainLen == actual->plainLen &&
+         expected->cipherLen == actual->cipherLen;
+}
+
+int64_t readBytes(BlockStream *in, uint8_t bytes[], size_t len) {
+  uint64_t start = statsStart();
+  int64_t read = streamRead(in, bytes, len);
+  statsStop(STAGE_READ, start);
+  if (read > 0)
+    statsBytesIn((size_t)read);
+  return read;
+}
+
+bool writeBytes(BlockStream *out, uint8_t bytes[], size_t len) {
+  uint64_t start = statsStart();
+  bool ok = streamWrite(out, bytes, len);
+  statsStop(STAGE_WRITE, start);
+  statsBytesOut(len);
+  return ok;
+}
+
+/* lengths are stored little-endian regardless of the host */
+void storeLength(uint8_t bytes[], size_t len) {
+  for (size_t i = 0; i < FRAME_HEADER / 2; i++) {
+    bytes[i] = (uint8_t)(len >> (8 * i));
+  }
+}
+
+size_t loadLength(uint8_t bytes[]) {
+  size_t len = 0;
+  for (size_t i = 0; i < FRAME_HEADER / 2; i++) {
+    len |= (size_t)bytes[i] << (8 * i);
+  }
+  return len;
 }
 
 /**
@@ -225,21 +707,28 @@ size_t readConsole(uint8_t **bytesPtr, Direction direction) {
   return lenBytes;
 }
 
-void consoleEncrypt(uint8_t bytes[], size_t len, uint8_t key[]) {
-  uint8_t block[BLOCK_SIZE];
-  printf("Encrypted text in hex: ");
-  for (size_t i = 0; i < (len / BLOCK_SIZE); i++) {
-    copy(block, 0, bytes, i * BLOCK_SIZE, BLOCK_SIZE);
-    encrypt(block, key);
-    printBytes(block, BLOCK_SIZE, ENCRYPT);
-  }
-  /* pad the last block using PKCS7 */
-  size_t remaining = len % BLOCK_SIZE;
-  copy(block, 0, bytes, (len / BLOCK_SIZE) * BLOCK_SIZE, remaining);
-  pad(block, remaining);
-  encrypt(block, key);
-  printBytes(block, BLOCK_SIZE, ENCRYPT);
-  printf("\n");
+/**
+ * The console modes run the same code as the file modes, reading from and
+ * writing to memory streams.
+ */
+bool consoleEncrypt(uint8_t bytes[], size_t len, uint8_t key[]) {
+  size_t cap = ((len / BLOCK_SIZE) + 1) * BLOCK_SIZE;
+  uint8_t *cipherBytes = (uint8_t *)malloc(cap);
+  BlockStream *in = streamFromMemory(bytes, len, 0);
+  BlockStream *out = streamFromMemory(cipherBytes, 0, cap);
+  bool ok = (cipherBytes != NULL) && (in != NULL) && (out != NULL) &&
+            encryptStream(in, out, key, false, STREAM_CHUNK, NULL);
+  if (ok) {
+    printf("Encrypted text in hex: ");
+    printBytes(cipherBytes, streamWritten(out), ENCRYPT);
+    printf("\n");
+  }
+  if (in != NULL)
+    streamClose(in);
+  if (out != NULL)
+    streamClose(out);
+  free(cipherBytes);
+  return ok;
 }
 
 bool consoleDecrypt(uint8_t bytes[], size_t len, uint8_t key[]) {
@@ -248,20 +737,24 @@ bool consoleDecrypt(uint8_t bytes[], size_t len, uint8_t key[]) {
     return false;
   }
 
-  uint8_t block[BLOCK_SIZE];
-  printf("Decrypted text: ");
-  for (size_t i = 0; i < len / BLOCK_SIZE; i++) {
-    copy(block, 0, bytes, i * BLOCK_SIZE, BLOCK_SIZE);
-    decrypt(block, key);
-    /* Remove the padding in the last block before printing result */
-    if (i == (len / BLOCK_SIZE - 1)) {
-      printBytes(block, BLOCK_SIZE - checkPad(block), DECRYPT);
-    } else {
-      printBytes(block, BLOCK_SIZE, DECRYPT);
-    }
+  uint8_t *plainBytes = (uint8_t *)malloc(len);
+  BlockStream *in = streamFromMemory(bytes, len, 0);
+  BlockStream *out = streamFromMemory(plainBytes, 0, len);
+  bool ok = (plainBytes != NULL) && (in != NULL) && (out != NULL) &&
+            decryptStream(in, out, key, false, STREAM_CHUNK, NULL);
+  if (ok) {
+    printf("Decrypted text: ");
+    printBytes(plainBytes, streamWritten(out), DECRYPT);
+    printf("\n");
   }
-  printf("\n");
-  return true;
+  if (in != NULL)
+    streamClose(in);
+  if (out != NULL)
+    streamClose(out);
+  if (plainBytes != NULL)
+    wipe(plainBytes, len);
+  free(plainBytes);
+  return ok;
 }
 
 /**
@@ -284,6 +777,29 @@ bool readKey(uint8_t key[], size_t len) {
   return true;
 }
 
+/**
+ * Reads a non-negative decimal number. Unlike strtoull alone, this rejects an
+ * empty string, a sign, trailing characters and values too large for 64 bits.
+ */
+bool parseCount(char *text, uint64_t *value) {
+  if (*text < '0' || *text > '9')
+    return false;
+  char *end;
+  errno = 0;
+  unsigned long long count = strtoull(text, &end, 10);
+  if (*end != '\0' || errno == ERANGE)
+    return false;
+  *value = (uint64_t)count;
+  return true;
+}
+
+/* Exits with an error message naming the file it is about */
+void fileError(char *msg, char *path) {
+  char text[BUF_LEN];
+  snprintf(text, BUF_LEN, "%s: %s", msg, path);
+  errorExit(text, 0, NULL);
+}
+
 void errorExit(char *msg, int numFiles, FILE *fpv[]) {
   fprintf(stderr, "%s\n", msg);
   for (int i = 0; i < numFiles; i++) {
@@ -0,0 +1,220 @@
+/**
+ * @file stats.c
+ * @brief Implements the per-stage instrumentation
+ *
+ * Each thread gets a record the first time it records anything. The record is
+ * linked into a global list under a lock once, and afterwards only its owner
+ * thread writes to it. Times are taken from the monotonic clock in
+ * nanoseconds.
+ *
+ * @author Ali Zaheer
+ */
+
+/* for clock_gettime */
+#define _POSIX_C_SOURCE 200809L
+
+/* -- Includes -- */
+#include "stats.h"     /* for public function prototypes */
+#include "key_cache.h" /* for the key cache counters */
+#include <stdatomic.h> /* for the enabled flag read by every thread */
+#include <stdlib.h>
+#include <threads.h> /* for the record list lock */
+#include <time.h>
+
+typedef struct ThreadStats {
+  uint64_t bytesIn;
+  uint64_t bytesOut;
+  uint64_t blocks;
+  uint64_t stageTime[NUM_STAGES];
+  uint64_t runHits; /* from the repeated block cache */
+  uint64_t zeroHits;
+  uint64_t slotHits;
+  uint64_t memoMisses;
+  uint64_t firstUse; /* when the thread started recording */
+  struct ThreadStats *next;
+} ThreadStats;
+
+static const char *STAGE_NAMES[NUM_STAGES] = {"read", "cipher", "write",
+                                              "compress", "checksum"};
+
+static atomic_bool enabled = false;
+static uint64_t wallStart;
+
+static mtx_t listLock;
+static once_flag initFlag = ONCE_FLAG_INIT;
+static ThreadStats *threadList = NULL;
+static _Thread_local ThreadStats *local = NULL;
+
+/* Local functions */
+static uint64_t now(void);
+static void initList(void);
+static ThreadStats *localStats(void);
+static bool isEnabled(void);
+
+void statsEnable(void) {
+  call_once(&initFlag, initList);
+  wallStart = now();
+  atomic_store_explicit(&enabled, true, memory_order_release);
+}
+
+uint64_t statsStart(void) { return isEnabled() ? now() : 0; }
+
+void statsStop(Stage stage, uint64_t start) {
+  if (isEnabled())
+    localStats()->stageTime[stage] += now() - start;
+}
+
+void statsBytesIn(size_t bytes) {
+  if (isEnabled())
+    localStats()->bytesIn += bytes;
+}
+
+void statsBytesOut(size_t bytes) {
+  if (isEnabled())
+    localStats()->bytesOut += bytes;
+}
+
+void statsBlocks(size_t blocks) {
+  if (isEnabled())
+    localStats()->blocks += blocks;
+}
+
+void statsMemo(const EcbMemo *memo) {
+  if (isEnabled()) {
+    ThreadStats *t = localStats();
+    t->runHits += memo->runHits;
+    t->zeroHits += memo->zeroHits;
+    t->slotHits += memo->slotHits;
+    t->memoMisses += memo->misses;
+  }
+}
+
+/**
+ * Utilization is the share of a thread's lifetime, from its first recording
+ * to the report, that it spent inside one of the timed stages.
+ */
+void statsReport(FILE *fp, bool json) {
+  if (!isEnabled())
+    return;
+
+  uint64_t end = now();
+  double wall = (double)(end - wallStart) / 1e9;
+  ThreadStats total = {0};
+
+  mtx_lock(&listLock);
+  for (ThreadStats *t = threadList; t != NULL; t = t->next) {
+    total.bytesIn += t->bytesIn;
+    total.bytesOut += t->bytesOut;
+    total.blocks += t->blocks;
+    total.runHits += t->runHits;
+    total.zeroHits += t->zeroHits;
+    total.slotHits += t->slotHits;
+    total.memoMisses += t->memoMisses;
+    for (int i = 0; i < NUM_STAGES; i++) {
+      total.stageTime[i] += t->stageTime[i];
+    }
+  }
+  double throughput = (wall > 0) ? (double)total.bytesIn / wall / 1e6 : 0;
+
+  KeyCacheStats keys;
+  keyCacheStats(&keys);
+
+  if (json) {
+    fprintf(fp, "{\"bytes_in\": %llu, \"bytes_out\": %llu, \"blocks\": %llu, ",
+            (unsigned long long)total.bytesIn,
+            (unsigned long long)total.bytesOut,
+            (unsigned long long)total.blocks);
+    fprintf(fp, "\"wall_s\": %.6f, \"throughput_mb_s\": %.3f, \"stages_s\": {",
+            wall, throughput);
+    for (int i = 0; i < NUM_STAGES; i++) {
+      fprintf(fp, "%s\"%s\": %.6f", i ? ", " : "", STAGE_NAMES[i],
+              (double)total.stageTime[i] / 1e9);
+    }
+    fprintf(fp, "}, \"thread_utilization\": [");
+  } else {
+    fprintf(fp, "bytes in:    %llu\nbytes out:   %llu\nblocks:      %llu\n",
+            (unsigned long long)total.bytesIn,
+            (unsigned long long)total.bytesOut,
+            (unsigned long long)total.blocks);
+    fprintf(fp, "wall time:   %.6f s\nthroughput:  %.3f MB/s\n", wall,
+            throughput);
+    for (int i = 0; i < NUM_STAGES; i++) {
+      fprintf(fp, "%-8s time: %.6f s\n", STAGE_NAMES[i],
+              (double)total.stageTime[i] / 1e9);
+    }
+  }
+
+  int n = 0;
+  for (ThreadStats *t = threadList; t != NULL; t = t->next, n++) {
+    uint64_t busy = 0;
+    for (int i = 0; i < NUM_STAGES; i++) {
+      busy += t->stageTime[i];
+    }
+    uint64_t life = end - t->firstUse;
+    double utilization = life ? 100.0 * (double)busy / (double)life : 0;
+    if (json)
+      fprintf(fp, "%s%.2f", n ? ", " : "", utilization);
+    else
+      fprintf(fp, "thread %d utilization: %.2f%%\n", n, utilization);
+  }
+  mtx_unlock(&listLock);
+
+  if (json) {
+    fprintf(fp, "], \"key_cache\": {\"hits\": %llu, \"misses\": %llu, "
+                "\"evictions\": %llu}, ",
+            keys.hits, keys.misses, keys.evictions);
+    fprintf(fp, "\"block_memo\": {\"run_hits\": %llu, \"zero_hits\": %llu, "
+                "\"slot_hits\": %llu, \"misses\": %llu}}\n",
+            (unsigned long long)total.runHits,
+            (unsigned long long)total.zeroHits,
+            (unsigned long long)total.slotHits,
+            (unsigned long long)total.memoMisses);
+  } else {
+    fprintf(fp, "key cache:   %llu hits, %llu misses, %llu evictions\n",
+            keys.hits, keys.misses, keys.evictions);
+    fprintf(fp, "block memo:  %llu run hits, %llu zero hits, %llu slot hits, "
+                "%llu misses\n",
+            (unsigned long long)total.runHits,
+            (unsigned long long)total.zeroHits,
+            (unsigned long long)total.slotHits,
+            (unsigned long long)total.memoMisses);
+  }
+}
+
+/* the flag is set once, and seeing it set also makes wallStart visible */
+bool isEnabled(void) {
+  return atomic_load_explicit(&enabled, memory_order_acquire);
+}
+
+/* falls back to the calendar clock where there is no monotonic clock */
+
+uint64_t now(void) {
+  struct timespec ts;
+#ifdef CLOCK_MONOTONIC
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+  timespec_get(&ts, TIME_UTC);
+#endif
+  return ((uint64_t)ts.tv_sec * 1000000000u) + (uint64_t)ts.tv_nsec;
+}
+
+void initList(void) { mtx_init(&listLock, mtx_plain); }
+
+/**
+ * Records are never freed, since a report may be printed after their threads
+ * have exited.
+ */
+ThreadStats *localStats(void) {
+  if (local == NULL) {
+    if ((local = (ThreadStats *)calloc(1, sizeof(ThreadStats))) == NULL) {
+      static ThreadStats fallback; /* shared, so counts may be lost */
+      return &fallback;
+    }
+    local->firstUse = now();
+    mtx_lock(&listLock);
+    local->next = threadList;
+    threadList = local;
+    mtx_unlock(&listLock);
+  }
+  return local;
+}
@@ -0,0 +1,98 @@
+/**
+ * @file stats.h
+ * @brief Function prototypes for the per-stage instrumentation
+ *
+ * Counts bytes and blocks and times the read, cipher, write, compression and
+ * checksum stages of the file modes. Every thread aggregates
+ * into its own record, so recording takes no locks, and the records are only
+ * combined when the report is printed. Recording is a no-op until
+ * statsEnable() is called.
+ *
+ * @author Ali Zaheer
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+/* -- Includes -- */
+#include "ecb_memo.h" /* for the repeated block cache counters */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum {
+  STAGE_READ,
+  STAGE_CIPHER,
+  STAGE_WRITE,
+  STAGE_COMPRESS,
+  STAGE_CHECKSUM
+} Stage;
+
+#define NUM_STAGES 5
+
+/**
+ * @brief Turns on recording and starts the wall clock for the report.
+ *
+ * Should be called before any thread that records is started, so that the
+ * report covers the whole of every thread's work.
+ */
+void statsEnable(void);
+
+/**
+ * @brief Starts timing a stage.
+ *
+ * Stages are timed once per chunk rather than once per block, so that reading
+ * the clock stays a negligible share of the work being timed.
+ *
+ * @return The current monotonic time in nanoseconds, or 0 if disabled
+ */
+uint64_t statsStart(void);
+
+/**
+ * @brief Adds the time elapsed since statsStart() to a stage.
+ *
+ * @param stage The stage being timed
+ * @param start Value returned by statsStart()
+ */
+void statsStop(Stage stage, uint64_t start);
+
+/**
+ * @brief Counts bytes read from the input.
+ *
+ * @param bytes Number of bytes
+ */
+void statsBytesIn(size_t bytes);
+
+/**
+ * @brief Counts bytes written to the output.
+ *
+ * @param bytes Number of bytes
+ */
+void statsBytesOut(size_t bytes);
+
+/**
+ * @brief Counts blocks passed through the cipher.
+ *
+ * @param blocks Number of blocks
+ */
+void statsBlocks(size_t blocks);
+
+/**
+ * @brief Adds the counters of a repeated block cache that is done with.
+ *
+ * @param memo The cache, before it is wiped
+ */
+void statsMemo(const EcbMemo *memo);
+
+/**
+ * @brief Prints the combined totals of every thread.
+ *
+ * The report covers bytes, blocks, time per stage, utilization per thread,
+ * throughput, the key cache counters and the repeated block cache counters.
+ *
+ * @param fp Stream to print to
+ * @param json True for a JSON object, false for human-readable text
+ */
+void statsReport(FILE *fp, bool json);
+
+#endif
@@ -0,0 +1,355 @@
+/**
+ * @file tuning.c
+ * @brief Implements the self-tuning of the file modes
+ *
+ * The CPU model comes from /proc/cpuinfo, so on other systems every host
+ * shares the entry for the model "unknown". The candidates are every
+ * combination of the chunk sizes in CHUNKS with memory mapping on and off.
+ *
+ * @author Ali Zaheer
+ */
+
+/* for mkstemp, fsync, posix_fadvise and clock_gettime */
+#define _POSIX_C_SOURCE 200809L
+
+/* -- Includes -- */
+#include "tuning.h"       /* for public function prototypes */
+#include "block_stream.h" /* for the candidate backends */
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LINE_LEN 512
+#define MODEL_LEN 256
+#define NUM_CHUNKS 3
+#define NUM_CANDIDATES (NUM_CHUNKS * 2) /* every chunk with and without mmap */
+#define NUM_RUNS 31    /* timed runs per candidate, judged by their median */
+#define MIN_GAIN 10    /* percent by which a candidate must beat the defaults */
+#define MARGIN 25      /* percent within which candidates count as a tie */
+
+static const size_t CHUNKS[NUM_CHUNKS] = {16384, STREAM_CHUNK, 262144};
+
+/**
+ * Candidate i has chunk size CHUNKS[i / 2] and maps the input if i is odd.
+ * The defaults come first, and ties between the others go to the default chunk
+ * size, then to the chunk sizes nearest to it.
+ */
+static const size_t PREFERENCE[NUM_CANDIDATES] = {3, 2, 1, 5, 0, 4};
+
+/* Local functions */
+static uint64_t measure(char *path, const Tuning *candidate, uint8_t buf[]);
+static uint64_t median(uint64_t times[], size_t count);
+static bool makeSample(char path[], size_t len);
+static void dropCache(char *path);
+static bool parseLine(char line[], Tuning *tuning, char **model);
+static bool validChunk(unsigned long long chunk);
+static bool tuningPath(char path[], size_t len);
+static void cpuModel(char model[], size_t len);
+static uint64_t now(void);
+
+void tuningDefaults(Tuning *tuning) {
+  tuning->chunk = STREAM_CHUNK;
+  tuning->map = true;
+}
+
+bool tuningLoad(Tuning *tuning) {
+  char path[LINE_LEN];
+  FILE *fp;
+  if (!tuningPath(path, LINE_LEN) || (fp = fopen(path, "r")) == NULL)
+    return false;
+
+  char model[MODEL_LEN];
+  cpuModel(model, MODEL_LEN);
+  char line[LINE_LEN];
+  char *lineModel;
+  Tuning entry;
+  bool found = false;
+  while (!found && fgets(line, LINE_LEN, fp) != NULL) {
+    if (parseLine(line, &entry, &lineModel) && strcmp(lineModel, model) == 0) {
+      *tuning = entry;
+      found = true;
+    }
+  }
+  fclose(fp);
+  return found;
+}
+
+/**
+ * Only the reads are timed. The cipher costs the same per block whatever the
+ * chunk size, and at its speed it would bury the differences being measured.
+ * The sample is dropped from the page cache before every run, so each one
+ * reads it cold, like the large files the file modes are tuned for. The
+ * candidates take turns run by run, and each run is compared with the run of
+ * the defaults in the same turn, so a disturbance on the host slows both sides
+ * of the comparison. Each candidate is judged by the median of those ratios,
+ * and only replaces the defaults if it beats them by MIN_GAIN percent. Of
+ * the candidates that do, those within MARGIN percent of the best count as a
+ * tie, which goes to the first in PREFERENCE. So chunk sizes that read at much
+ * the same speed give the same result every time, and a host where nothing
+ * clearly wins, like one reading from memory, keeps the defaults.
+ */
+bool tuningCalibrate(Tuning *tuning) {
+  tuningDefaults(tuning);
+  char path[LINE_LEN];
+  uint8_t *buf = streamBuffer(CHUNKS[NUM_CHUNKS - 1]);
+  if (buf == NULL)
+    return false;
+  if (!makeSample(path, LINE_LEN)) {
+    free(buf);
+    return false;
+  }
+
+  Tuning candidates[NUM_CANDIDATES];
+  for (size_t i = 0; i < NUM_CANDIDATES; i++) {
+    candidates[i].chunk = CHUNKS[i / 2];
+    candidates[i].map = (i % 2) == 1;
+  }
+  uint64_t times[NUM_CANDIDATES][NUM_RUNS];
+  for (size_t run = 0; run < NUM_RUNS; run++) {
+    for (size_t i = 0; i < NUM_CANDIDATES; i++) {
+      dropCache(path);
+      times[i][run] = measure(path, &candidates[i], buf);
+    }
+  }
+  unlink(path);
+  free(buf);
+
+  /* runs are compared with the defaults' run of the same turn, in permille */
+  size_t defaults = PREFERENCE[0];
+  uint64_t ratios[NUM_CANDIDATES];
+  uint64_t best = UINT64_MAX;
+  for (size_t i = 0; i < NUM_CANDIDATES; i++) {
+    uint64_t runRatios[NUM_RUNS];
+    for (size_t run = 0; run < NUM_RUNS; run++) {
+      uint64_t base = times[defaults][run];
+      runRatios[run] = (times[i][run] == UINT64_MAX || base == UINT64_MAX)
+                           ? UINT64_MAX
+                           : times[i][run] * 1000 / (base ? base : 1);
+    }
+    ratios[i] = median(runRatios, NUM_RUNS);
+    if (ratios[i] < best)
+      best = ratios[i];
+  }
+  if (best == UINT64_MAX)
+    return false;
+
+  /* of the candidates that beat the defaults, ties go by PREFERENCE */
+  uint64_t limit = best * (100 + MARGIN) / 100;
+  uint64_t gain = 1000 - MIN_GAIN * 10;
+  for (size_t p = 1; p < NUM_CANDIDATES; p++) {
+    size_t i = PREFERENCE[p];
+    if (ratios[i] <= limit && ratios[i] <= gain) {
+      *tuning = candidates[i];
+      break;
+    }
+  }
+  return true;
+}
+
+/**
+ * The new file is written to a unique temporary file next to the old one,
+ * synced and renamed over it. Hosts sharing the tuning file never write to the
+ * same temporary file, and a crash never leaves half a file. If two hosts save
+ * at once, the file is one of their two versions, never a mix of both.
+ */
+bool tuningSave(const Tuning *tuning) {
+  char path[LINE_LEN];
+  char tempPath[LINE_LEN + sizeof(".XXXXXX")];
+  if (!tuningPath(path, LINE_LEN))
+    return false;
+  snprintf(tempPath, sizeof(tempPath), "%s.XXXXXX", path);
+  int fd = mkstemp(tempPath);
+  if (fd < 0)
+    return false;
+  FILE *out = fdopen(fd, "w");
+  if (out == NULL) {
+    close(fd);
+    unlink(tempPath);
+    return false;
+  }
+  fchmod(fd, 0644); /* mkstemp only lets the owner read it */
+
+  char model[MODEL_LEN];
+  cpuModel(model, MODEL_LEN);
+  FILE *in = fopen(path, "r");
+  if (in != NULL) {
+    char line[LINE_LEN];
+    char copyLine[LINE_LEN];
+    char *lineModel;
+    Tuning entry;
+    while (fgets(line, LINE_LEN, in) != NULL) {
+      memcpy(copyLine, line, LINE_LEN);
+      if (parseLine(line, &entry, &lineModel) && strcmp(lineModel, model) != 0)
+        fputs(copyLine, out);
+    }
+    fclose(in);
+  }
+  fprintf(out, "%zu %s %s\n", tuning->chunk, tuning->map ? "mmap" : "read",
+          model);
+
+  bool ok = (fflush(out) == 0) && (fsync(fd) == 0);
+  ok = (fclose(out) == 0) && ok;
+  ok = ok && (rename(tempPath, path) == 0);
+  if (!ok)
+    unlink(tempPath);
+  return ok;
+}
+
+bool tuningParse(char *text, Tuning *tuning) {
+  char *end;
+  unsigned long long chunk = strtoull(text, &end, 10);
+  if (end == text || *end != ',' || !validChunk(chunk))
+    return false;
+  if (strcmp(end + 1, "mmap") == 0) {
+    tuning->map = true;
+  } else if (strcmp(end + 1, "read") == 0) {
+    tuning->map = false;
+  } else {
+    return false;
+  }
+  tuning->chunk = (size_t)chunk;
+  return true;
+}
+
+/* Returns the time taken to open and read the sample, in nanoseconds */
+uint64_t measure(char *path, const Tuning *candidate, uint8_t buf[]) {
+  uint64_t start = now();
+  BlockStream *in = streamOpenRead(path, candidate->map);
+  if (in == NULL)
+    return UINT64_MAX;
+  int64_t bytes;
+  while ((bytes = streamRead(in, buf, candidate->chunk)) > 0)
+    continue;
+  uint64_t elapsed = now() - start;
+  streamClose(in);
+  return (bytes < 0) ? UINT64_MAX : elapsed;
+}
+
+/* sorts the times in place, a failed run counting as the slowest */
+uint64_t median(uint64_t times[], size_t count) {
+  for (size_t i = 1; i < count; i++) {
+    uint64_t time = times[i];
+    size_t j = i;
+    for (; j > 0 && times[j - 1] > time; j--) {
+      times[j] = times[j - 1];
+    }
+    times[j] = time;
+  }
+  return times[count / 2];
+}
+
+/**
+ * The sample is filled from a xorshift generator so it isn't all zeros. It
+ * goes in /var/tmp rather than /tmp, which is often kept in memory, and is
+ * synced so that its pages can be dropped from the cache.
+ */
+bool makeSample(char path[], size_t len) {
+  const char *dir = getenv("TMPDIR");
+  snprintf(path, len, "%s/aes_tuneXXXXXX", (dir != NULL) ? dir : "/var/tmp");
+  int fd = mkstemp(path);
+  if (fd < 0)
+    return false;
+  BlockStream *out = streamFromFd(fd);
+  if (out == NULL) {
+    close(fd);
+    unlink(path);
+    return false;
+  }
+
+  uint8_t block[4096];
+  uint64_t state = 0x9E3779B97F4A7C15u;
+  bool ok = true;
+  for (size_t done = 0; ok && done < TUNING_SAMPLE; done += sizeof(block)) {
+    for (size_t i = 0; i < sizeof(block); i++) {
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      block[i] = (uint8_t)state;
+    }
+    ok = streamWrite(out, block, sizeof(block));
+  }
+  ok = ok && (fsync(fd) == 0);
+  ok = streamClose(out) && ok;
+  if (!ok)
+    unlink(path);
+  return ok;
+}
+
+void dropCache(char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd >= 0) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+}
+
+/* the CPU model is the rest of the line, since it may have spaces */
+bool parseLine(char line[], Tuning *tuning, char **model) {
+  unsigned long long chunk;
+  char mode[8];
+  int start;
+  if (sscanf(line, "%llu %7s %n", &chunk, mode, &start) != 2 ||
+      !validChunk(chunk))
+    return false;
+  if (strcmp(mode, "mmap") == 0) {
+    tuning->map = true;
+  } else if (strcmp(mode, "read") == 0) {
+    tuning->map = false;
+  } else {
+    return false;
+  }
+  tuning->chunk = (size_t)chunk;
+  *model = &line[start];
+  (*model)[strcspn(*model, "\n")] = '\0';
+  return true;
+}
+
+/* chunks must keep direct I/O aligned, and so are also whole blocks */
+bool validChunk(unsigned long long chunk) {
+  return chunk >= STREAM_ALIGN && chunk <= TUNING_MAX_CHUNK &&
+         (chunk % STREAM_ALIGN) == 0;
+}
+
+bool tuningPath(char path[], size_t len) {
+  const char *env = getenv("AES_TUNING");
+  const char *home = getenv("HOME");
+  if (env != NULL) {
+    snprintf(path, len, "%s", env);
+  } else if (home != NULL) {
+    snprintf(path, len, "%s/.aes_tuning", home);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void cpuModel(char model[], size_t len) {
+  snprintf(model, len, "unknown");
+  FILE *fp = fopen("/proc/cpuinfo", "r");
+  if (fp == NULL)
+    return;
+
+  char line[LINE_LEN];
+  char *colon;
+  while (fgets(line, LINE_LEN, fp) != NULL) {
+    if (strncmp(line, "model name", 10) == 0 &&
+        (colon = strchr(line, ':')) != NULL) {
+      colon += strspn(colon, ": \t");
+      colon[strcspn(colon, "\n")] = '\0';
+      snprintf(model, len, "%s", colon);
+      break;
+    }
+  }
+  fclose(fp);
+}
+
+uint64_t now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000u) + (uint64_t)ts.tv_nsec;
+}
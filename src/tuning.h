@@ -0,0 +1,87 @@
+/**
+ * @file tuning.h
+ * @brief Function prototypes for the self-tuning of the file modes
+ *
+ * How fast a file is processed depends on the host as well as the code: the
+ * best chunk size depends on the CPU's caches, and whether memory mapping the
+ * input beats plain reads depends on the kernel. A configuration is picked on
+ * request by timing every candidate on a sample file, and the winner is kept in
+ * a tuning file that later runs on the same kind of CPU read back.
+ *
+ * The tuning file is a text file with one line per CPU model:
+ * <chunk size> <mmap|read> <CPU model>
+ * It is $AES_TUNING if set, otherwise .aes_tuning in the home directory, so a
+ * home directory shared across different machines keeps an entry for each.
+ *
+ * @author Ali Zaheer
+ */
+
+#ifndef TUNING_H
+#define TUNING_H
+
+/* -- Includes -- */
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TUNING_SAMPLE (16 * 1024 * 1024) /* bytes read per candidate run */
+#define TUNING_MAX_CHUNK (16 * 1024 * 1024) /* largest chunk size allowed */
+
+typedef struct {
+  size_t chunk; /* bytes moved per call, a multiple of STREAM_ALIGN */
+  bool map;     /* memory map the input instead of reading it */
+} Tuning;
+
+/**
+ * @brief Gives the built-in configuration.
+ *
+ * @param tuning Set to STREAM_CHUNK with memory mapping
+ */
+void tuningDefaults(Tuning *tuning);
+
+/**
+ * @brief Looks up the configuration for this CPU in the tuning file.
+ *
+ * @param tuning Set to the stored configuration if there is one
+ *
+ * @return True if one was found, otherwise false
+ */
+bool tuningLoad(Tuning *tuning);
+
+/**
+ * @brief Times every candidate configuration and picks the fastest.
+ *
+ * Each candidate reads a temporary file of TUNING_SAMPLE bytes from start to
+ * finish several times, and is judged by its median time relative to the
+ * built-in configuration. The file is made in $TMPDIR if set, otherwise
+ * /var/tmp.
+ *
+ * @param tuning Set to the fastest configuration if it clearly beats the
+ * built-in one, otherwise to the built-in one
+ *
+ * @return True if the candidates were measured, otherwise false
+ */
+bool tuningCalibrate(Tuning *tuning);
+
+/**
+ * @brief Stores the configuration for this CPU in the tuning file.
+ *
+ * An older entry for the same CPU is replaced, and entries for other CPUs are
+ * kept.
+ *
+ * @param tuning The configuration
+ *
+ * @return True if the tuning file was written, otherwise false
+ */
+bool tuningSave(const Tuning *tuning);
+
+/**
+ * @brief Reads a configuration given as "<chunk size>,<mmap|read>".
+ *
+ * @param text The configuration
+ * @param tuning Set to the configuration if it is valid
+ *
+ * @return True if the text was valid, otherwise false
+ */
+bool tuningParse(char *text, Tuning *tuning);
+
+#endif
@@ -0,0 +1,307 @@
+/**
+ * @file update.c
+ * @brief Implements incremental re-encryption
+ *
+ * Chunk i covers bytes [i * UPDATE_CHUNK, (i + 1) * UPDATE_CHUNK) of both the
+ * plaintext and the ciphertext. A file of n bytes has n / UPDATE_CHUNK + 1
+ * chunks, where the last one holds the remaining bytes plus the PKCS7 padding
+ * block, so it is the only chunk whose ciphertext is longer than its
+ * plaintext.
+ *
+ * The manifest is a binary file made of:
+ * 1. The magic string "AESMANI2"
+ * 2. The chunk size, 8 bytes little-endian
+ * 3. The plaintext length, 8 bytes little-endian
+ * 4. The first 8 bytes of the all-zero block encrypted with the key, used to
+ *    detect a change of key
+ * 5. The modification time of the ciphertext, as 8 bytes of seconds and 8
+ *    bytes of nanoseconds, little-endian
+ * 6. One 8 byte little-endian digest per chunk
+ *
+ * Each digest also covers the chunk's length, so a chunk that only grew or
+ * shrank is still rewritten, along with its padding. The modification time is
+ * taken after the ciphertext is synced, so a ciphertext written by anything
+ * other than a finished update, including an update that crashed half way,
+ * no longer matches and gets rewritten in full.
+ *
+ * @author Ali Zaheer
+ */
+
+/* for fsync and st_mtim, with 64-bit offsets on 32-bit hosts */
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
+/* -- Includes -- */
+#include "update.h"       /* for public function prototype */
+#include "block_stream.h" /* for positioned reads and writes of both files */
+#include "byte_ops.h"     /* for copy and wipe */
+#include "ecb_memo.h"     /* for the repeated block cache */
+#include "key_cache.h"    /* for the expanded key schedule */
+#include "stats.h"        /* for the --stats report */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAGIC "AESMANI2"
+#define HEADER_LEN 48 /* magic, chunk size, length, key check, mtime */
+
+/* Local functions */
+static uint64_t *loadManifest(char *path, uint8_t check[],
+                              const struct stat *cipher, uint64_t *oldLen);
+static bool saveManifest(char *path, uint8_t check[],
+                         const struct stat *cipher, uint64_t len,
+                         uint64_t digests[], uint64_t count);
+static uint64_t keyedDigest(uint8_t bytes[], size_t len, uint64_t index,
+                            const KeySchedule *schedule);
+static uint64_t digest(uint8_t bytes[], size_t len);
+static bool readFull(BlockStream *in, uint8_t buf[], size_t len,
+                     uint64_t offset);
+static void storeU64(uint8_t bytes[], uint64_t value);
+static uint64_t loadU64(uint8_t bytes[]);
+
+bool fileUpdate(char *plainPath, char *cipherPath, uint8_t key[], bool memoize,
+                uint64_t *rewritten, uint64_t *total) {
+  KeySchedule schedule;
+  keyCacheGet(key, &schedule);
+  uint8_t check[BLOCK_SIZE];
+  memset(check, 0, BLOCK_SIZE);
+  encryptBlock(check, &schedule);
+  EcbMemo memo;
+  if (memoize)
+    memoInit(&memo, &schedule, ENCRYPT);
+
+  size_t pathLen = strlen(cipherPath);
+  char *manifestPath = (char *)malloc(pathLen + sizeof(".manifest"));
+  uint8_t *chunk = (uint8_t *)malloc(UPDATE_CHUNK + BLOCK_SIZE);
+  uint64_t *digests = NULL;
+  uint64_t *oldDigests = NULL;
+  uint64_t oldLen = 0;
+  BlockStream *in = NULL;
+  BlockStream *out = NULL;
+  struct stat info;
+  bool ok = (manifestPath != NULL) && (chunk != NULL) &&
+            ((in = streamOpenRead(plainPath, false)) != NULL) &&
+            ((out = streamOpenUpdate(cipherPath)) != NULL) &&
+            streamStat(in, &info);
+
+  uint64_t len = ok ? (uint64_t)info.st_size : 0;
+  uint64_t count = (len / UPDATE_CHUNK) + 1;
+  uint64_t oldCount = 0;
+  if (ok) {
+    memcpy(manifestPath, cipherPath, pathLen);
+    memcpy(&manifestPath[pathLen], ".manifest", sizeof(".manifest"));
+    ok = (digests = (uint64_t *)malloc(count * sizeof(uint64_t))) != NULL;
+    if (streamStat(out, &info))
+      oldDigests = loadManifest(manifestPath, check, &info, &oldLen);
+    if (oldDigests != NULL)
+      oldCount = (oldLen / UPDATE_CHUNK) + 1;
+  }
+
+  *rewritten = 0;
+  for (uint64_t i = 0; ok && i < count; i++) {
+    uint64_t offset = i * UPDATE_CHUNK;
+    size_t chunkLen = (i == count - 1) ? (size_t)(len - offset) : UPDATE_CHUNK;
+
+    uint64_t start = statsStart();
+    ok = readFull(in, chunk, chunkLen, offset);
+    statsStop(STAGE_READ, start);
+    statsBytesIn(chunkLen);
+    if (!ok)
+      break;
+    digests[i] = keyedDigest(chunk, chunkLen, i, &schedule);
+    if (i < oldCount && oldDigests[i] == digests[i])
+      continue;
+
+    /* the last chunk gets the padding, which may be a block of its own */
+    size_t cipherLen = chunkLen;
+    if (i == count - 1) {
+      size_t tail = chunkLen % BLOCK_SIZE;
+      pad(&chunk[chunkLen - tail], tail);
+      cipherLen = chunkLen - tail + BLOCK_SIZE;
+    }
+
+    start = statsStart();
+    if (memoize) {
+      memoBlocks(&memo, chunk, cipherLen);
+    } else {
+      for (size_t j = 0; j < cipherLen; j += BLOCK_SIZE) {
+        encryptBlock(&chunk[j], &schedule);
+      }
+    }
+    statsStop(STAGE_CIPHER, start);
+    statsBlocks(cipherLen / BLOCK_SIZE);
+
+    start = statsStart();
+    ok = streamPwrite(out, chunk, cipherLen, offset);
+    statsStop(STAGE_WRITE, start);
+    statsBytesOut(cipherLen);
+    (*rewritten)++;
+  }
+  *total = count;
+
+  /* drop ciphertext left over from a longer old version */
+  uint64_t cipherSize = ((len / BLOCK_SIZE) + 1) * BLOCK_SIZE;
+  ok = ok && streamTruncate(out, cipherSize);
+  ok = ok && streamSync(out) && streamStat(out, &info);
+  ok = ok && saveManifest(manifestPath, check, &info, len, digests, count);
+
+  if (in != NULL)
+    streamClose(in);
+  if (out != NULL)
+    ok = streamClose(out) && ok;
+  free(manifestPath);
+  free(chunk);
+  free(digests);
+  free(oldDigests);
+  if (memoize) {
+    statsMemo(&memo);
+    memoWipe(&memo);
+  }
+  wipe(check, BLOCK_SIZE);
+  wipe((uint8_t *)&schedule, sizeof(schedule));
+  return ok;
+}
+
+/**
+ * Returns NULL if the manifest is missing, corrupt, was made with a different
+ * chunk size or key, or doesn't match the ciphertext's length and modification
+ * time, in which case every chunk counts as changed.
+ */
+uint64_t *loadManifest(char *path, uint8_t check[],
+                       const struct stat *cipher, uint64_t *oldLen) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL)
+    return NULL;
+
+  uint8_t header[HEADER_LEN];
+  uint64_t *digests = NULL;
+  if (fread(header, sizeof(uint8_t), HEADER_LEN, fp) == HEADER_LEN &&
+      memcmp(header, MAGIC, 8) == 0 && loadU64(&header[8]) == UPDATE_CHUNK &&
+      memcmp(&header[24], check, 8) == 0 &&
+      loadU64(&header[32]) == (uint64_t)cipher->st_mtim.tv_sec &&
+      loadU64(&header[40]) == (uint64_t)cipher->st_mtim.tv_nsec &&
+      (uint64_t)cipher->st_size ==
+          ((loadU64(&header[16]) / BLOCK_SIZE) + 1) * BLOCK_SIZE) {
+    *oldLen = loadU64(&header[16]);
+    uint64_t count = (*oldLen / UPDATE_CHUNK) + 1;
+    uint8_t word[8];
+    if ((digests = (uint64_t *)malloc(count * sizeof(uint64_t))) != NULL) {
+      for (uint64_t i = 0; i < count; i++) {
+        if (fread(word, sizeof(uint8_t), 8, fp) != 8) {
+          free(digests);
+          digests = NULL;
+          break;
+        }
+        digests[i] = loadU64(word);
+      }
+    }
+  }
+  fclose(fp);
+  return digests;
+}
+
+/**
+ * The manifest is written to a temporary file, synced and renamed over the
+ * old one, and the rename is synced through the directory, so a crash leaves
+ * either the old manifest or the new one. The old one no longer matches the
+ * ciphertext's modification time, so it is ignored.
+ */
+bool saveManifest(char *path, uint8_t check[], const struct stat *cipher,
+                  uint64_t len, uint64_t digests[], uint64_t count) {
+  size_t pathLen = strlen(path);
+  char *tempPath = (char *)malloc(pathLen + sizeof(".tmp"));
+  if (tempPath == NULL)
+    return false;
+  memcpy(tempPath, path, pathLen);
+  memcpy(&tempPath[pathLen], ".tmp", sizeof(".tmp"));
+
+  FILE *fp = fopen(tempPath, "wb");
+  bool ok = (fp != NULL);
+  if (ok) {
+    uint8_t header[HEADER_LEN];
+    memcpy(header, MAGIC, 8);
+    storeU64(&header[8], UPDATE_CHUNK);
+    storeU64(&header[16], len);
+    copy(header, 24, check, 0, 8);
+    storeU64(&header[32], (uint64_t)cipher->st_mtim.tv_sec);
+    storeU64(&header[40], (uint64_t)cipher->st_mtim.tv_nsec);
+    ok = fwrite(header, sizeof(uint8_t), HEADER_LEN, fp) == HEADER_LEN;
+
+    uint8_t word[8];
+    for (uint64_t i = 0; ok && i < count; i++) {
+      storeU64(word, digests[i]);
+      ok = fwrite(word, sizeof(uint8_t), 8, fp) == 8;
+    }
+    ok = ok && (fflush(fp) == 0) && (fsync(fileno(fp)) == 0);
+    ok = (fclose(fp) == 0) && ok;
+  }
+  ok = ok && (rename(tempPath, path) == 0);
+  if (!ok)
+    remove(tempPath);
+  ok = ok && streamSyncDir(path);
+  free(tempPath);
+  return ok;
+}
+
+/**
+ * The digest is keyed by encrypting the plain hash together with the chunk's
+ * index, so the manifest can't be used to test guesses of the plaintext
+ * without the key, and equal chunks at different positions don't show up as
+ * equal digests.
+ */
+uint64_t keyedDigest(uint8_t bytes[], size_t len, uint64_t index,
+                     const KeySchedule *schedule) {
+  uint8_t block[BLOCK_SIZE];
+  storeU64(block, digest(bytes, len));
+  storeU64(&block[8], index);
+  encryptBlock(block, schedule);
+  uint64_t tag = loadU64(block);
+  wipe(block, BLOCK_SIZE);
+  return tag;
+}
+
+/**
+ * A 64-bit multiply-rotate hash over 8 byte words, seeded with the length. It
+ * is not cryptographic; it only has to tell changed chunks apart.
+ */
+uint64_t digest(uint8_t bytes[], size_t len) {
+  const uint64_t P1 = 0x9E3779B185EBCA87u;
+  const uint64_t P2 = 0xC2B2AE3D27D4EB4Fu;
+  uint64_t hash = P1 ^ (uint64_t)len;
+  uint64_t word;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    memcpy(&word, &bytes[i], 8);
+    hash ^= word * P2;
+    hash = ((hash << 31) | (hash >> 33)) * P1;
+  }
+  for (; i < len; i++) {
+    hash ^= bytes[i] * P2;
+    hash = ((hash << 11) | (hash >> 53)) * P1;
+  }
+  hash ^= hash >> 33;
+  hash *= P2;
+  hash ^= hash >> 29;
+  return hash;
+}
+
+/* a read that ends early means the plaintext shrank, which is an error */
+bool readFull(BlockStream *in, uint8_t buf[], size_t len, uint64_t offset) {
+  return streamPread(in, buf, len, offset) == (int64_t)len;
+}
+
+void storeU64(uint8_t bytes[], uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    bytes[i] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+uint64_t loadU64(uint8_t bytes[]) {
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++) {
+    value |= (uint64_t)bytes[i] << (8 * i);
+  }
+  return value;
+}
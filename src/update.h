@@ -0,0 +1,47 @@
+/**
+ * @file update.h
+ * @brief Function prototype for incremental re-encryption
+ *
+ * In ECB mode every block of ciphertext only depends on the block of plaintext
+ * at the same position, so when a large file changes in a few places only the
+ * changed parts need to be encrypted again. The file is split into chunks of
+ * UPDATE_CHUNK bytes, and a manifest next to the ciphertext stores a keyed
+ * digest of the plaintext of each chunk. An update compares the new plaintext
+ * against the manifest and only rewrites the chunks whose digest changed.
+ *
+ * @author Ali Zaheer
+ */
+
+#ifndef UPDATE_H
+#define UPDATE_H
+
+/* -- Includes -- */
+#include "AES.h" /* for BLOCK_SIZE */
+#include <stdbool.h>
+#include <stdint.h>
+
+#define UPDATE_CHUNK (1 << 20) /* bytes per chunk, a multiple of BLOCK_SIZE */
+
+/**
+ * @brief Brings a ciphertext file up to date with a new version of its
+ * plaintext.
+ *
+ * The manifest is stored at the ciphertext path with ".manifest" appended. If
+ * the ciphertext or manifest doesn't exist yet, the manifest was made with a
+ * different key or chunk size, or the ciphertext was modified since the
+ * manifest was saved, every chunk is written. The result is the
+ * same as encrypting the new plaintext from scratch.
+ *
+ * @param plainPath Path of the new plaintext
+ * @param cipherPath Path of the ciphertext to update in place
+ * @param key The key
+ * @param memoize True to use the repeated block cache
+ * @param rewritten Where to store the number of chunks written
+ * @param total Where to store the number of chunks in the file
+ *
+ * @return True if successful, otherwise false
+ */
+bool fileUpdate(char *plainPath, char *cipherPath, uint8_t key[], bool memoize,
+                uint64_t *rewritten, uint64_t *total);
+
+#endif